@@ -0,0 +1,83 @@
+#!/bin/sh
+#
+# bench.sh - time xinit against the stub X server
+#
+# usage: bench.sh <dir> [runs] [server delay ms]
+#
+# <dir> holds the xinit built by 'make bench' (its config file is <dir>/config)
+# and xstub. Every run writes a trace (see 'trace-file' in data/config), from
+# which we take:
+#
+#   config-to-exec   parse_config start until the server exec
+#   exec-to-ready    server exec until displayfd / SIGUSR1 / socket / listenfd
+#   shutdown         the whole shutdown () phase
+#
+# and print p50/p95/p99 in microseconds.
+
+dir=$1
+runs=${2:-100}
+delay=${3:-0}
+
+if [ -z "$dir" ] || [ ! -x "$dir/xinit" ] || [ ! -x "$dir/xstub" ]; then
+  echo "usage: $0 <dir with xinit and xstub> [runs] [server delay ms]" >&2
+  exit 1
+fi
+
+dir=$(cd "$dir" && pwd)
+trace="$dir/trace.json"
+samples="$dir/samples"
+
+cat > "$dir/config" <<EOF
+allowed-users=anybody
+drop-root=no
+allow-chmod=no
+rights-cache=no
+server-timeout=5000
+term-grace=2000
+kill-grace=1000
+trace-file=$trace
+EOF
+
+: > "$samples"
+failed=0
+run=0
+while [ $run -lt "$runs" ]; do
+  run=$((run + 1))
+  rm -f "$trace"
+
+  if ! "$dir/xinit" /bin/true -- "$dir/xstub" -delay "$delay" >"$dir/xinit.log" 2>&1; then
+    failed=$((failed + 1))
+    continue
+  fi
+
+  # One event per line: pick the name, ts and dur fields
+  awk -F'"' '
+    {
+      name = $4
+      ts = $0; sub(/.*"ts":/, "", ts); sub(/[,}].*/, "", ts)
+      dur = $0; sub(/.*"dur":/, "", dur); sub(/[,}].*/, "", dur)
+    }
+    name == "parse_config"  { config = ts }
+    name == "server exec"   { exec = ts }
+    name == "displayfd" || name == "SIGUSR1" || name == "socket accepts" || name == "listenfd answers" { if (!ready) ready = ts }
+    name == "shutdown"      { shutdown = dur }
+    END {
+      if (config && exec && ready && shutdown != "")
+        printf "%d %d %d\n", exec - config, ready - exec, shutdown
+    }' "$trace" >> "$samples"
+done
+
+count=$(wc -l < "$samples")
+echo "xinit bench: $count/$runs runs, server delay ${delay} ms"
+[ "$failed" -ne 0 ] && echo "  $failed runs failed, last log in $dir/xinit.log"
+[ "$count" -eq 0 ] && exit 1
+
+printf "  %-16s %10s %10s %10s\n" phase p50 p95 p99
+col=1
+for phase in config-to-exec exec-to-ready shutdown; do
+  cut -d' ' -f$col "$samples" | sort -n | awk -v phase="$phase" '
+    { v[NR] = $1 }
+    function rank(p,  i) { i = int((p * NR + 99) / 100); return v[i < 1 ? 1 : i] }
+    END { printf "  %-16s %8d us %7d us %7d us\n", phase, rank(50), rank(95), rank(99) }'
+  col=$((col + 1))
+done
@@ -0,0 +1,150 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * spawn - fork () + execv () against the spawn layer of src/spawn.c
+ *
+ * usage: spawn [runs] [program]
+ *
+ * For each way 'program' (/bin/true) is started 'runs' times and we
+ * print p50/p95/p99 of
+ *
+ *   launch   how long the parent is busy starting the child; for spawn ()
+ *            that includes knowing the exec went through
+ *   reaped   until the child has exited and been reaped
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "spawn.h"
+
+
+/*
+ * Code
+ */
+
+static int
+compare (const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+print (const char *name, long long *samples, int runs)
+{
+    qsort (samples, runs, sizeof (long long), compare);
+    printf ("  %-20s %8lld us %7lld us %7lld us\n", name,
+        samples [(runs * 50 + 99) / 100 - 1],
+        samples [(runs * 95 + 99) / 100 - 1],
+        samples [(runs * 99 + 99) / 100 - 1]);
+}
+
+static int
+with_fork (char **argv, long long *launch, long long *reaped)
+{
+    long long start;
+    pid_t pid;
+
+    start = mono_us ();
+    pid = fork ();
+    if ( pid == 0 ) {
+        execv (argv [0], argv);
+        _exit (127);
+    }
+    *launch = mono_us () - start;
+
+    if ( pid == -1 || waitpid (pid, NULL, 0) != pid )
+        return False;
+
+    *reaped = mono_us () - start;
+    return True;
+}
+
+static int
+with_spawn (char **argv, int safe, long long *launch, long long *reaped)
+{
+    long long start;
+    Spawn sp;
+    pid_t pid;
+    int pidfd;
+
+    spawn_init (&sp, argv);
+    sp.safe = safe;
+
+    start = mono_us ();
+    pid = spawn (&sp, &pidfd);
+    *launch = mono_us () - start;
+    spawn_close (&sp);
+
+    if ( pid == -1 || waitpid (pid, NULL, 0) != pid )
+        return False;
+
+    *reaped = mono_us () - start;
+    if ( pidfd != -1 )
+        close (pidfd);
+    return True;
+}
+
+int
+main (int argc, char *argv[])
+{
+    static const char *names [] = { "fork+execv", "spawn (fork)", "spawn (clone3)" };
+    char *child [2];
+    long long *launch [3], *reaped [3];
+    int runs, way, idx;
+
+    prog_name = "spawn";
+    runs = argc > 1 ? atoi (argv [1]) : 1000;
+    child [0] = argc > 2 ? argv [2] : (char *) "/bin/true";
+    child [1] = NULL;
+
+    if ( runs <= 0 )
+        return EXIT_FAILURE;
+
+    for ( way = 0; way < 3; way++ ) {
+        launch [way] = calloc (runs, sizeof (long long));
+        reaped [way] = calloc (runs, sizeof (long long));
+        if ( launch [way] == NULL || reaped [way] == NULL )
+            return EXIT_FAILURE;
+    }
+
+    /* Interleaved, so that all three see the same machine */
+    for ( idx = 0; idx < runs; idx++ ) {
+        if ( !with_fork (child, launch [0] + idx, reaped [0] + idx) ||
+             !with_spawn (child, False, launch [1] + idx, reaped [1] + idx) ||
+             !with_spawn (child, True, launch [2] + idx, reaped [2] + idx) ) {
+            errorx ("could not run %s", child [0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf ("spawn bench: %d runs of %s\n", runs, child [0]);
+    printf ("  %-20s %11s %10s %10s\n", "", "p50", "p95", "p99");
+    for ( way = 0; way < 3; way++ ) {
+        printf ("%s\n", names [way]);
+        print ("launch", launch [way], runs);
+        print ("reaped", reaped [way], runs);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,468 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * xstub - a stand-in X server for 'make bench'
+ *
+ * Takes the arguments startServer () passes (":N", "-displayfd <fd>",
+ * "-listenfd <fd>", anything else is ignored) and behaves like Xorg as far
+ * as xinit can tell: it listens on the display socket, or on the ones it
+ * is given, reports readiness through
+ * -displayfd and SIGUSR1, answers the connection setup and replies to
+ * the few requests XOpenDisplay () and XCloseDisplay () send.
+ *
+ *   -delay <ms>     wait that long before listening, as if initialising
+ *   -nodisplayfd    do not answer on -displayfd, only SIGUSR1
+ *   -hang <ms>      stop answering that long after listening, as if hung
+ *
+ * A ChangeProperty gets the PropertyNotify the xinit watchdog waits for.
+ */
+
+#define _GNU_SOURCE  /* accept4 */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>  /* offsetof */
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+
+#define SOCKET_DIR    "/tmp/.X11-unix"
+#define MAX_CLIENTS   16
+#define MAX_LISTEN    4
+#define REPLY_SIZE    32
+
+#define ROOT_WINDOW   0x25
+#define COLORMAP      0x20
+#define ROOT_VISUAL   0x21
+#define INTERN_ATOM   16
+#define CHANGE_PROPERTY  18
+#define PROPERTY_NOTIFY  28
+
+#define MAX(a, b)     ((a) > (b) ? (a) : (b))
+
+
+typedef struct {
+    int fd;
+    int setup;                  /* connection setup done */
+    unsigned short sequence;
+    unsigned char buf [4096];
+    int len;
+} Client;
+
+
+static const char *prog_name = "xstub";
+static char socket_path [sizeof (((struct sockaddr_un *) 0)->sun_path)];
+static volatile sig_atomic_t quit = 0;
+static Client clients [MAX_CLIENTS];
+static unsigned long next_atom = 256;   /* past the predefined ones */
+
+/* Core requests that get a reply, an empty one is good enough for Xlib */
+static const unsigned char reply_opcodes [] = {
+    3, 14, 15, 16, 17, 20, 21, 23, 26, 31, 38, 39, 40, 43, 44, 47, 48, 49,
+    50, 52, 73, 83, 84, 85, 86, 87, 91, 92, 97, 98, 99, 101, 103, 106, 108,
+    110, 116, 117, 118, 119
+};
+
+
+/*
+ * Code
+ */
+
+static void
+on_signal (int signo)
+{
+    quit = signo;
+}
+
+static void
+put16 (unsigned char *p, unsigned v)
+{
+    /* Little endian, see setup () */
+    p [0] = v & 0xFF;
+    p [1] = (v >> 8) & 0xFF;
+}
+
+static void
+put32 (unsigned char *p, unsigned long v)
+{
+    put16 (p, v & 0xFFFF);
+    put16 (p + 2, (v >> 16) & 0xFFFF);
+}
+
+static long long
+now_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int
+write_all (int fd, const unsigned char *buf, int len)
+{
+    ssize_t count;
+
+    while ( len > 0 ) {
+        count = write (fd, buf, len);
+        if ( count == -1 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+            return 0;
+
+        buf += count;
+        len -= count;
+    }
+    return 1;
+}
+
+static int
+listen_on (int display)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd;
+
+    if ( mkdir (SOCKET_DIR, 01777) == 0 )
+        chmod (SOCKET_DIR, 01777);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    snprintf (socket_path, sizeof (socket_path), "%s/X%d", SOCKET_DIR, display);
+    strcpy (addr.sun_path, socket_path);
+    unlink (socket_path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( fd == -1 )
+        return -1;
+
+    len = offsetof (struct sockaddr_un, sun_path) + strlen (socket_path) + 1;
+    if ( bind (fd, (struct sockaddr *) &addr, len) == -1 || listen (fd, 16) == -1 ) {
+        fprintf (stderr, "%s: could not listen on %s: %s\n", prog_name, socket_path, strerror (errno));
+        close (fd);
+        *socket_path = '\0';
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * The smallest setup reply Xlib accepts: one 1024x768 TrueColor screen
+ * with a single depth 24 visual.
+ */
+static int
+setup (Client *client)
+{
+    static const char vendor [] = "xinit bench";
+    unsigned char reply [8 + 32 + 12 + 8 + 40 + 8 + 24];
+    unsigned char *p = reply;
+    int vlen = (sizeof (vendor) - 1 + 3) & ~3;
+    int nauth, dauth, need;
+
+    /* byte-order, pad, major, minor, auth name and data lengths, pad */
+    if ( client->len < 12 )
+        return 1;
+
+    nauth = client->buf [6] | (client->buf [7] << 8);
+    dauth = client->buf [8] | (client->buf [9] << 8);
+    need = 12 + ((nauth + 3) & ~3) + ((dauth + 3) & ~3);
+    if ( client->len < need )
+        return 1;
+
+    if ( client->buf [0] != 'l' ) {
+        fprintf (stderr, "%s: only little endian clients are supported\n", prog_name);
+        return 0;
+    }
+    memmove (client->buf, client->buf + need, client->len - need);
+    client->len -= need;
+
+    memset (reply, 0, sizeof (reply));
+    p [0] = 1;                      /* Success */
+    put16 (p + 2, 11);
+    put16 (p + 4, 0);
+    put16 (p + 6, (sizeof (reply) - 8 - 12 + vlen) / 4);
+    p += 8;
+
+    put32 (p, 1);                   /* release */
+    put32 (p + 4, 0x00400000);      /* resource id base */
+    put32 (p + 8, 0x001FFFFF);      /* resource id mask */
+    put16 (p + 16, sizeof (vendor) - 1);
+    put16 (p + 18, 0xFFFF);         /* maximum request length */
+    p [20] = 1;                     /* screens */
+    p [21] = 1;                     /* pixmap formats */
+    p [24] = 32;                    /* bitmap scanline unit */
+    p [25] = 32;                    /* bitmap scanline pad */
+    p [26] = 8;                     /* min keycode */
+    p [27] = 255;                   /* max keycode */
+    p += 32;
+
+    memcpy (p, vendor, sizeof (vendor) - 1);
+    p += 12;
+
+    p [0] = 24;                     /* format: depth, bits per pixel, pad */
+    p [1] = 32;
+    p [2] = 32;
+    p += 8;
+
+    put32 (p, ROOT_WINDOW);         /* screen */
+    put32 (p + 4, COLORMAP);
+    put32 (p + 8, 0xFFFFFF);
+    put32 (p + 12, 0);
+    put16 (p + 20, 1024);
+    put16 (p + 22, 768);
+    put16 (p + 24, 270);
+    put16 (p + 26, 203);
+    put16 (p + 28, 1);
+    put16 (p + 30, 1);
+    put32 (p + 32, ROOT_VISUAL);
+    p [38] = 24;                    /* root depth */
+    p [39] = 1;                     /* depths */
+    p += 40;
+
+    p [0] = 24;                     /* depth */
+    put16 (p + 2, 1);               /* visuals */
+    p += 8;
+
+    put32 (p, ROOT_VISUAL);         /* visual */
+    p [4] = 4;                      /* TrueColor */
+    p [5] = 8;
+    put16 (p + 6, 256);
+    put32 (p + 8, 0xFF0000);
+    put32 (p + 12, 0x00FF00);
+    put32 (p + 16, 0x0000FF);
+
+    client->setup = 1;
+    return write_all (client->fd, reply, sizeof (reply));
+}
+
+static int
+has_reply (unsigned char opcode)
+{
+    unsigned idx;
+
+    for ( idx = 0; idx < sizeof (reply_opcodes); idx++ ) {
+        if ( reply_opcodes [idx] == opcode )
+            return 1;
+    }
+    return 0;
+}
+
+static int
+requests (Client *client)
+{
+    unsigned char reply [REPLY_SIZE];
+    int len;
+
+    while ( client->len >= 4 ) {
+        len = (client->buf [2] | (client->buf [3] << 8)) * 4;
+        if ( len == 0 ) {
+            /* BIG-REQUESTS is not announced, nobody should send these */
+            fprintf (stderr, "%s: unexpected big request\n", prog_name);
+            return 0;
+        }
+        if ( client->len < len )
+            break;
+
+        client->sequence++;
+        if ( has_reply (client->buf [0]) ) {
+            memset (reply, 0, sizeof (reply));
+            reply [0] = 1;          /* Reply */
+            put16 (reply + 2, client->sequence);
+            if ( client->buf [0] == INTERN_ATOM )
+                put32 (reply + 8, next_atom++);
+            if ( !write_all (client->fd, reply, sizeof (reply)) )
+                return 0;
+        }
+        if ( client->buf [0] == CHANGE_PROPERTY && len >= 24 ) {
+            /* Whoever changes it is taken to have selected the event */
+            memset (reply, 0, sizeof (reply));
+            reply [0] = PROPERTY_NOTIFY;
+            put16 (reply + 2, client->sequence);
+            memcpy (reply + 4, client->buf + 4, 8);   /* window, atom */
+            if ( !write_all (client->fd, reply, sizeof (reply)) )
+                return 0;
+        }
+        memmove (client->buf, client->buf + len, client->len - len);
+        client->len -= len;
+    }
+    return 1;
+}
+
+static void
+serve (Client *client)
+{
+    ssize_t count;
+    int ok;
+
+    count = read (client->fd, client->buf + client->len, sizeof (client->buf) - client->len);
+    if ( count == -1 && errno == EINTR )
+        return;
+
+    ok = count > 0;
+    if ( ok ) {
+        client->len += count;
+        if ( !client->setup )
+            ok = setup (client);
+        if ( ok && client->setup )
+            ok = requests (client);
+        if ( ok && client->len == (int) sizeof (client->buf) )
+            ok = 0;
+    }
+
+    if ( !ok ) {
+        close (client->fd);
+        client->fd = -1;
+    }
+}
+
+static void
+accept_client (int listenfd)
+{
+    int idx, fd;
+
+    fd = accept4 (listenfd, NULL, NULL, SOCK_CLOEXEC);
+    if ( fd == -1 )
+        return;
+
+    for ( idx = 0; idx < MAX_CLIENTS && clients [idx].fd != -1; idx++ )
+        ;  /* NOP */
+
+    if ( idx == MAX_CLIENTS ) {
+        close (fd);
+        return;
+    }
+    memset (clients + idx, 0, sizeof (Client));
+    clients [idx].fd = fd;
+}
+
+int
+main (int argc, char *argv[])
+{
+    struct pollfd fds [MAX_LISTEN + MAX_CLIENTS];
+    struct sigaction sa, old;
+    struct timespec delay;
+    int display = -1, displayfd = -1, use_displayfd = 1, delay_ms = 0, hang_ms = -1;
+    int listenfds [MAX_LISTEN], nlisten = 0;
+    int idx, nfds, notify, timeout;
+    long long hang_at = -1;
+    char buf [16];
+
+    for ( idx = 1; idx < argc; idx++ ) {
+        if ( argv [idx][0] == ':' )
+            display = atoi (argv [idx] + 1);
+        else if ( strcmp (argv [idx], "-displayfd") == 0 && idx + 1 < argc )
+            displayfd = atoi (argv [++idx]);
+        else if ( strcmp (argv [idx], "-listenfd") == 0 && idx + 1 < argc && nlisten < MAX_LISTEN )
+            listenfds [nlisten++] = atoi (argv [++idx]);
+        else if ( strcmp (argv [idx], "-delay") == 0 && idx + 1 < argc )
+            delay_ms = atoi (argv [++idx]);
+        else if ( strcmp (argv [idx], "-nodisplayfd") == 0 )
+            use_displayfd = 0;
+        else if ( strcmp (argv [idx], "-hang") == 0 && idx + 1 < argc )
+            hang_ms = atoi (argv [++idx]);
+    }
+
+    /* Like Xorg: an ignored SIGUSR1 means the parent wants one when ready */
+    sigaction (SIGUSR1, NULL, &old);
+    notify = old.sa_handler == SIG_IGN;
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = on_signal;
+    sigaction (SIGTERM, &sa, NULL);
+    sigaction (SIGINT, &sa, NULL);
+    sigaction (SIGHUP, &sa, NULL);
+
+    if ( display < 0 ) {
+        /* -displayfd without a display: pick one, xinit learns it from us */
+        if ( displayfd == -1 ) {
+            fprintf (stderr, "%s: no display given\n", prog_name);
+            return EXIT_FAILURE;
+        }
+        display = 90 + getpid () % 100;
+    }
+
+    if ( delay_ms > 0 ) {
+        delay.tv_sec = delay_ms / 1000;
+        delay.tv_nsec = (long) (delay_ms % 1000) * 1000000;
+        while ( nanosleep (&delay, &delay) == -1 && errno == EINTR && !quit )
+            ;  /* NOP */
+    }
+
+    /* Sockets we are given are already bound, and not ours to remove */
+    if ( nlisten == 0 ) {
+        listenfds [0] = listen_on (display);
+        if ( listenfds [0] == -1 )
+            return EXIT_FAILURE;
+        nlisten = 1;
+    }
+
+    if ( use_displayfd && displayfd != -1 ) {
+        snprintf (buf, sizeof (buf), "%d\n", display);
+        write_all (displayfd, (unsigned char *) buf, strlen (buf));
+    }
+    if ( displayfd != -1 )
+        close (displayfd);
+
+    if ( notify )
+        kill (getppid (), SIGUSR1);
+
+    for ( idx = 0; idx < MAX_CLIENTS; idx++ )
+        clients [idx].fd = -1;
+
+    if ( hang_ms >= 0 )
+        hang_at = now_ms () + hang_ms;
+
+    while ( !quit ) {
+        /* Hung: connections stay open, nothing is read from them */
+        timeout = -1;
+        if ( hang_at != -1 )
+            timeout = MAX (hang_at - now_ms (), 0);
+
+        for ( idx = 0; idx < MAX_LISTEN; idx++ ) {
+            fds [idx].fd = idx < nlisten ? listenfds [idx] : -1;
+            fds [idx].events = POLLIN;
+        }
+        for ( idx = 0; idx < MAX_CLIENTS; idx++ ) {
+            fds [MAX_LISTEN + idx].fd = timeout == 0 ? -1 : clients [idx].fd;
+            fds [MAX_LISTEN + idx].events = POLLIN;
+        }
+        nfds = poll (fds, MAX_LISTEN + MAX_CLIENTS, timeout == 0 ? -1 : timeout);
+        if ( nfds <= 0 )
+            continue;
+
+        for ( idx = 0; idx < nlisten; idx++ ) {
+            if ( fds [idx].revents & POLLIN )
+                accept_client (listenfds [idx]);
+        }
+
+        for ( idx = 0; idx < MAX_CLIENTS; idx++ ) {
+            if ( clients [idx].fd != -1 && fds [MAX_LISTEN + idx].revents != 0 )
+                serve (clients + idx);
+        }
+    }
+
+    if ( *socket_path != '\0' )
+        unlink (socket_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include "util.h"
+#include "devices.h"
+#include "cache.h"
+#include "seat.h"
+
+
+#define CACHE_DIR     "/run/xinit"
+#define CACHE_RIGHTS  "rights.%d"
+#define CACHE_SEAT    "rights.%d.%s"  /* a seat probes its own devices */
+#define CACHE_LENGTH  64
+#define CACHE_MAX     4096  /* bytes per entry */
+
+#define FNV_OFFSET    0xcbf29ce484222325ULL
+#define FNV_PRIME     0x100000001b3ULL
+
+
+/*
+ * Code
+ */
+
+static unsigned long long
+fnv (unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+
+    while ( len-- != 0 ) {
+        hash ^= *p++;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static unsigned long long
+hash_device (unsigned long long hash, const Device *dev)
+{
+    long long ctime = dev->ctime;
+    unsigned long long rdev = dev->rdev, ino = dev->ino;
+
+    /* Field by field to stay clear of struct padding */
+    hash = fnv (hash, &dev->cls, sizeof (dev->cls));
+    hash = fnv (hash, &dev->index, sizeof (dev->index));
+    hash = fnv (hash, &dev->mode, sizeof (dev->mode));
+    hash = fnv (hash, &dev->uid, sizeof (dev->uid));
+    hash = fnv (hash, &dev->gid, sizeof (dev->gid));
+    hash = fnv (hash, &rdev, sizeof (rdev));
+    hash = fnv (hash, &ino, sizeof (ino));
+    return fnv (hash, &ctime, sizeof (ctime));
+}
+
+/*
+ * The key covers everything the cached probes look at: the user, the
+ * groups, the kernel (drm master rules changed in 4.x) and the state of
+ * every fb, drm and input node. ttys are left out on purpose, which VTs
+ * are free changes from one start to the next.
+ */
+unsigned long long
+cache_key (uid_t uid, const gid_t *grouplist, int ngroups)
+{
+    static const DevClass classes [] = { DevFb, DevDrm, DevEvent };
+    unsigned long long hash = FNV_OFFSET;
+    struct utsname uts;
+    Device *dev;
+    int idx, count;
+
+    hash = fnv (hash, &uid, sizeof (uid));
+    hash = fnv (hash, &ngroups, sizeof (ngroups));
+    hash = fnv (hash, grouplist, ngroups * sizeof (gid_t));
+
+    if ( uname (&uts) == 0 )
+        hash = fnv (hash, uts.release, strlen (uts.release));
+
+    for ( idx = 0; idx < (int) countof (classes); idx++ ) {
+        for ( dev = devices_class (classes [idx], &count); count != 0; dev++, count-- )
+            hash = hash_device (hash, dev);
+    }
+    return hash;
+}
+
+static int
+trusted (int fd)
+{
+    struct stat st;
+
+    /* A forged "no rights" answer would keep the server running as root */
+    if ( fstat (fd, &st) == -1 )
+        return False;
+
+    return S_ISREG (st.st_mode) && st.st_uid == geteuid () && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/*
+ * Return the contents of CACHE_DIR/name as a string, or NULL when missing
+ * or not trusted; the caller frees it.
+ */
+char *
+cache_load (const char *name)
+{
+    char path [CACHE_LENGTH + sizeof (CACHE_DIR)];
+    char *data;
+    ssize_t count;
+    int fd;
+
+    snprintf (path, sizeof (path), "%s/%s", CACHE_DIR, name);
+
+    fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if ( fd == -1 )
+        return NULL;
+
+    if ( !trusted (fd) ) {
+        debugx ("cache: %s is not trusted", path);
+        close (fd);
+        return NULL;
+    }
+
+    data = x_malloc (CACHE_MAX + 1);
+    if ( data == NULL ) {
+        close (fd);
+        return NULL;
+    }
+
+    count = read (fd, data, CACHE_MAX);
+    close (fd);
+
+    if ( count <= 0 ) {
+        free (data);
+        return NULL;
+    }
+    data [count] = '\0';
+    return data;
+}
+
+/*
+ * Atomically replace CACHE_DIR/name; readers never see half a file.
+ */
+int
+cache_save (const char *name, const char *data)
+{
+    char path [CACHE_LENGTH + sizeof (CACHE_DIR)];
+    char temp [CACHE_LENGTH + sizeof (CACHE_DIR) + 12];
+    ssize_t len;
+    int fd;
+
+    if ( mkdir (CACHE_DIR, 0755) == -1 && errno != EEXIST ) {
+        debug ("cache: could not create %s", CACHE_DIR);
+        return False;
+    }
+
+    snprintf (path, sizeof (path), "%s/%s", CACHE_DIR, name);
+    snprintf (temp, sizeof (temp), "%s.%d", path, (int) getpid ());
+
+    fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if ( fd == -1 ) {
+        debug ("cache: could not create %s", temp);
+        return False;
+    }
+
+    len = strlen (data);
+    if ( write (fd, data, len) != len || close (fd) == -1 || rename (temp, path) == -1 ) {
+        debug ("cache: could not write %s", path);
+        unlink (temp);
+        return False;
+    }
+    return True;
+}
+
+static void
+rights_name (char *name, int size, uid_t uid)
+{
+    if ( seat_name () != NULL )
+        snprintf (name, size, CACHE_SEAT, (int) uid, seat_name ());
+    else
+        snprintf (name, size, CACHE_RIGHTS, (int) uid);
+}
+
+int
+cache_lookup (uid_t uid, unsigned long long key, int *results, int count)
+{
+    char name [CACHE_LENGTH];
+    unsigned long long stored;
+    char *data, *p, *end;
+    int idx, result = False;
+
+    rights_name (name, sizeof (name), uid);
+
+    data = cache_load (name);
+    if ( data == NULL ) {
+        debugx ("rights cache miss: no %s", name);
+        return False;
+    }
+
+    stored = strtoull (data, &p, 16);
+    if ( p == data || stored != key ) {
+        debugx ("rights cache miss: key %016llx changed", key);
+        goto quit;
+    }
+
+    for ( idx = 0; idx < count; idx++, p = end ) {
+        results [idx] = strtol (p, &end, 10);
+        if ( end == p || results [idx] == DIE ) {
+            debugx ("rights cache miss: %s is corrupted", name);
+            goto quit;
+        }
+    }
+    debugx ("rights cache hit: key %016llx", key);
+    result = True;
+
+quit:
+
+    free (data);
+    return result;
+}
+
+void
+cache_store (uid_t uid, unsigned long long key, const int *results, int count)
+{
+    char name [CACHE_LENGTH];
+    char buf [256];
+    int idx, len;
+
+    rights_name (name, sizeof (name), uid);
+
+    len = snprintf (buf, sizeof (buf), "%016llx", key);
+    for ( idx = 0; idx < count && len < (int) sizeof (buf) - 16; idx++ )
+        len += snprintf (buf + len, sizeof (buf) - len, " %d", results [idx]);
+    buf [len++] = '\n';
+    buf [len] = '\0';
+
+    if ( cache_save (name, buf) )
+        debugx ("rights cache stored: key %016llx", key);
+}
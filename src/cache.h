@@ -0,0 +1,31 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <sys/types.h>
+
+
+char * cache_load (const char *name);
+int cache_save (const char *name, const char *data);
+unsigned long long cache_key (uid_t uid, const gid_t *grouplist, int ngroups);
+int cache_lookup (uid_t uid, unsigned long long key, int *results, int count);
+void cache_store (uid_t uid, unsigned long long key, const int *results, int count);
+
+
+#endif  /* _CACHE_H */
@@ -0,0 +1,346 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* pipe2, F_SETPIPE_SZ, memrchr */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>  /* PATH_MAX */
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "loop.h"
+#include "capture.h"
+
+
+#define CAPTURE_PIPE   (1 << 20)   /* slack for when we are busy elsewhere */
+#define CAPTURE_READ   65536
+
+
+typedef struct {
+    const char *name;
+    const char *where;    /* the 'server-output' value, NULL to inherit */
+    int rfd;              /* our end of the pipe */
+    int wfd;              /* the child's end until it has been spawned */
+    int out;              /* log file */
+    int size;             /* bytes in the log file */
+    char *ring;           /* or the last 'output-size' bytes */
+    int head;
+    int full;
+} Capture;
+
+
+/*
+ * Output capture: with 'server-output' or 'client-output' set, the child's
+ * stdout and stderr go into a pipe that the event loop drains, whichever
+ * loop_wait () runs, into a log file rotated at 'output-size' bytes, or
+ * into a ring of that size which goes to our stderr only when the child
+ * dies on a signal or with an error. Either way a slow terminal never
+ * holds up the server.
+ */
+static Capture captures [2] = {
+    { "server", NULL, -1, -1, -1, 0, NULL, 0, False },
+    { "client", NULL, -1, -1, -1, 0, NULL, 0, False }
+};
+
+static char buf [CAPTURE_READ];
+
+
+/*
+ * Code
+ */
+
+static void
+open_log (Capture *cap, int flags)
+{
+    struct stat st;
+
+    cap->out = open (cap->where, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0600);
+    if ( cap->out == -1 ) {
+        error ("unable to open %s output log %s", cap->name, cap->where);
+        return;
+    }
+    cap->size = fstat (cap->out, &st) == 0 ? st.st_size : 0;
+}
+
+/* log -> log.1 -> ... -> log.<output-keep>, the last one goes */
+static void
+rotate (Capture *cap)
+{
+    char from [PATH_MAX], to [PATH_MAX];
+    int idx;
+
+    close (cap->out);
+    for ( idx = u_output_keep; idx > 0; idx-- ) {
+        if ( idx > 1 )
+            snprintf (from, sizeof (from), "%s.%d", cap->where, idx - 1);
+        else
+            snprintf (from, sizeof (from), "%s", cap->where);
+        snprintf (to, sizeof (to), "%s.%d", cap->where, idx);
+
+        if ( rename (from, to) == -1 && errno != ENOENT )
+            debug ("unable to rotate %s", from);
+    }
+    open_log (cap, O_TRUNC);
+}
+
+static void
+append_ring (Capture *cap, const char *data, int len)
+{
+    int part;
+
+    if ( len > u_output_size ) {
+        data += len - u_output_size;
+        len = u_output_size;
+        cap->full = True;
+    }
+
+    part = MIN (len, u_output_size - cap->head);
+    memcpy (cap->ring + cap->head, data, part);
+    memcpy (cap->ring, data + part, len - part);
+
+    if ( cap->head + len >= u_output_size )
+        cap->full = True;
+    cap->head = (cap->head + len) % u_output_size;
+}
+
+static void
+append_log (Capture *cap, const char *data, int len)
+{
+    const char *eol;
+    ssize_t count;
+    int part;
+
+    while ( len > 0 ) {
+        if ( cap->out != -1 && cap->size >= u_output_size )
+            rotate (cap);
+
+        if ( cap->out == -1 )
+            return;
+
+        /* Up to the size limit, at a line end: a line that does not fit
+         * starts the next file, unless it would not fit there either */
+        part = MIN (len, u_output_size - cap->size);
+        if ( part < len ) {
+            eol = memrchr (data, '\n', part);
+            if ( eol != NULL )
+                part = eol - data + 1;
+            else if ( cap->size > 0 ) {
+                rotate (cap);
+                continue;
+            }
+        }
+
+        count = write (cap->out, data, part);
+        if ( count <= 0 )
+            return;
+
+        cap->size += count;
+        data += count;
+        len -= count;
+    }
+}
+
+static Capture *
+find_rfd (int fd)
+{
+    int idx;
+
+    for ( idx = 0; idx < (int) countof (captures); idx++ ) {
+        if ( captures [idx].rfd == fd )
+            return captures + idx;
+    }
+    return NULL;
+}
+
+static void
+close_pipe (Capture *cap)
+{
+    loop_unwatch_fd (cap->rfd);
+    close (cap->rfd);
+    cap->rfd = -1;
+}
+
+/* loop_wait () calls this, and we call it on the way out */
+static void
+drain (int fd)
+{
+    Capture *cap = find_rfd (fd);
+    ssize_t count;
+
+    if ( cap == NULL )
+        return;
+
+    for ( ;; ) {
+        count = read (fd, buf, sizeof (buf));
+        if ( count > 0 ) {
+            if ( cap->ring != NULL )
+                append_ring (cap, buf, count);
+            else
+                append_log (cap, buf, count);
+            continue;
+        }
+
+        if ( count == -1 && errno == EINTR )
+            continue;
+
+        /* EOF: the child and everything it started has let go of it */
+        if ( count == 0 || errno != EAGAIN )
+            close_pipe (cap);
+        return;
+    }
+}
+
+/*
+ * A pipe for the child to be spawned: from here to capture_parent () the
+ * child's end is held for capture_child (). Without capture, or should
+ * anything fail, the child simply inherits our stdout and stderr.
+ */
+void
+capture_prepare (CaptureTree tree)
+{
+    Capture *cap = captures + tree;
+    int fds [2];
+
+    cap->where = tree == CaptureServer ? u_server_output : u_client_output;
+    if ( cap->where == NULL )
+        return;
+
+    /* What a former server or client left in its pipe */
+    if ( cap->rfd != -1 ) {
+        drain (cap->rfd);
+        if ( cap->rfd != -1 )
+            close_pipe (cap);
+    }
+
+    if ( cap->ring == NULL && cap->out == -1 ) {
+        if ( strcmp (cap->where, "ring") == 0 ) {
+            cap->ring = x_malloc (u_output_size);
+            if ( cap->ring == NULL )
+                return;
+        } else {
+            open_log (cap, 0);
+            if ( cap->out == -1 )
+                return;
+        }
+    }
+
+    if ( pipe2 (fds, O_CLOEXEC) == -1 ) {
+        error ("unable to create a pipe for the %s output", cap->name);
+        return;
+    }
+
+    /* Best effort, the default 64 KiB will do otherwise */
+    fcntl (fds [1], F_SETPIPE_SZ, CAPTURE_PIPE);
+    fcntl (fds [0], F_SETFL, O_NONBLOCK);
+
+    if ( !loop_drain_fd (fds [0], drain) ) {
+        close (fds [0]);
+        close (fds [1]);
+        return;
+    }
+    cap->rfd = fds [0];
+    cap->wfd = fds [1];
+}
+
+/* In the child before exec: async-signal-safe */
+void
+capture_child (CaptureTree tree)
+{
+    Capture *cap = captures + tree;
+
+    if ( cap->wfd == -1 )
+        return;
+
+    /* dup2 () leaves the copies without O_CLOEXEC */
+    dup2 (cap->wfd, STDOUT_FILENO);
+    dup2 (cap->wfd, STDERR_FILENO);
+}
+
+/* The child has its copy, ours would keep EOF from ever coming */
+void
+capture_parent (CaptureTree tree)
+{
+    Capture *cap = captures + tree;
+
+    if ( cap->wfd != -1 ) {
+        close (cap->wfd);
+        cap->wfd = -1;
+    }
+}
+
+/*
+ * The child exited: a ring goes to stderr unless it did so with success,
+ * it is all we have to tell why it went.
+ */
+void
+capture_exited (CaptureTree tree, int status)
+{
+    Capture *cap = captures + tree;
+    ssize_t unused;
+
+    if ( cap->rfd != -1 )
+        drain (cap->rfd);
+
+    if ( cap->ring == NULL || (WIFEXITED (status) && WEXITSTATUS (status) == 0) )
+        return;
+
+    if ( !cap->full && cap->head == 0 )
+        return;
+
+    fprintf (stderr, "---- last output of the %s ----\n", cap->name);
+    if ( cap->full )
+        unused = write (STDERR_FILENO, cap->ring + cap->head, u_output_size - cap->head);
+    unused = write (STDERR_FILENO, cap->ring, cap->head);
+    (void) unused;
+    fprintf (stderr, "\n---- end of %s output ----\n", cap->name);
+
+    cap->head = 0;
+    cap->full = False;
+}
+
+void
+capture_close (void)
+{
+    Capture *cap;
+    int idx;
+
+    for ( idx = 0; idx < (int) countof (captures); idx++ ) {
+        cap = captures + idx;
+        if ( cap->rfd != -1 ) {
+            drain (cap->rfd);
+            if ( cap->rfd != -1 )
+                close_pipe (cap);
+        }
+        capture_parent (idx);
+
+        if ( cap->out != -1 )
+            close (cap->out);
+        cap->out = -1;
+
+        free (cap->ring);
+        cap->ring = NULL;
+    }
+}
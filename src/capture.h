@@ -0,0 +1,35 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+
+typedef enum {
+    CaptureServer,
+    CaptureClient
+} CaptureTree;
+
+
+void capture_prepare (CaptureTree tree);
+void capture_child (CaptureTree tree);
+void capture_parent (CaptureTree tree);
+void capture_exited (CaptureTree tree, int status);
+void capture_close (void);
+
+
+#endif  /* _CAPTURE_H */
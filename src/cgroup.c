@@ -0,0 +1,409 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>  /* PATH_MAX */
+#include <sys/stat.h>
+
+#include "util.h"
+#include "cgroup.h"
+#include "seat.h"
+
+
+#define CGROUP_SELF   "/proc/self/cgroup"
+
+
+/*
+ * cgroup v2 placement: with 'cgroup' set, xinit takes a cgroup delegated
+ * to it ("auto" is the one it was started in, as with a systemd unit with
+ * Delegate=yes) and splits it into
+ *
+ *   supervisor/   xinit itself, processes may only live in leaves
+ *   server/       the X server,           'server-cgroup' settings
+ *   client/       the client and its tree, 'client-cgroup' settings
+ *
+ * with the cpu, io and memory controllers enabled for them. With seats the
+ * supervisor sets up the base once and every seat child shares its leaf,
+ * while the server and client cgroups move one level down, into a
+ * <seat>/ of their own. Settings are
+ * interface files and values, "cpu.weight=1000 memory.low=512M". Nothing
+ * of this is fatal: without a usable cgroup everything stays where it is.
+ */
+/* Unified, or the v2 part of a hybrid hierarchy */
+static const char * const roots [] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+static const char * const tree_names [] = { "server", "client" };
+static const char * const controllers [] = { "cpu", "io", "memory" };
+
+static char base [PATH_MAX];      /* empty when not in use */
+static char trees [PATH_MAX];     /* parent of server/ and client/ */
+static int in_seat = False;       /* trees is a seat's, base is not ours */
+static char origin [PATH_MAX];    /* where we were started */
+static char enabled [32];         /* what we wrote to cgroup.subtree_control */
+static int fds [2] = { -1, -1 };
+static int created = False;       /* base itself is ours to remove */
+
+
+/*
+ * Code
+ */
+
+/* All paths are PATH_MAX long: a truncated one would be some other cgroup */
+static int
+join (char *path, const char *dir, const char *name)
+{
+    return snprintf (path, PATH_MAX, "%s/%s", dir, name) < PATH_MAX;
+}
+
+static int
+write_file (const char *dir, const char *name, const char *value)
+{
+    char path [PATH_MAX];
+    ssize_t count;
+    int fd;
+
+    if ( !join (path, dir, name) )
+        return False;
+
+    fd = open (path, O_WRONLY | O_CLOEXEC);
+    if ( fd == -1 )
+        return False;
+
+    count = write (fd, value, strlen (value));
+    close (fd);
+    return count == (ssize_t) strlen (value);
+}
+
+static int
+read_file (const char *path, char *buf, int size)
+{
+    ssize_t count;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 )
+        return False;
+
+    count = read (fd, buf, size - 1);
+    close (fd);
+    if ( count < 0 )
+        return False;
+
+    buf [count] = '\0';
+    return True;
+}
+
+/* Ours from the "0::<path>" line */
+static int
+own_cgroup (char *path, int size)
+{
+    char buf [PATH_MAX + 64], *p, *end;
+
+    if ( !read_file (CGROUP_SELF, buf, sizeof (buf)) )
+        return False;
+
+    for ( p = buf; p != NULL; p = end != NULL ? end + 1 : NULL ) {
+        end = strchr (p, '\n');
+        if ( end != NULL )
+            *end = '\0';
+
+        if ( strncmp (p, "0::", 3) == 0 )
+            return snprintf (path, size, "%s", p + 3) < size;
+    }
+    return False;
+}
+
+static const char *
+find_root (void)
+{
+    char path [64];
+    int idx;
+
+    for ( idx = 0; idx < (int) countof (roots); idx++ ) {
+        snprintf (path, sizeof (path), "%s/cgroup.controllers", roots [idx]);
+        if ( access (path, F_OK) == 0 )
+            return roots [idx];
+    }
+    return NULL;
+}
+
+static int
+has_word (const char *list, const char *word)
+{
+    int len = strlen (word);
+    const char *p;
+
+    for ( p = strstr (list, word); p != NULL; p = strstr (p + 1, word) ) {
+        if ( (p == list || p [-1] == ' ') && (p [len] == '\0' || p [len] == ' ' || p [len] == '\n') )
+            return True;
+    }
+    return False;
+}
+
+static int
+enable_controllers (const char *dir)
+{
+    char path [PATH_MAX], available [256];
+    int idx, len = 0;
+
+    if ( !join (path, dir, "cgroup.controllers") || !read_file (path, available, sizeof (available)) )
+        return False;
+
+    for ( idx = 0; idx < (int) countof (controllers); idx++ ) {
+        if ( has_word (available, controllers [idx]) )
+            len += snprintf (enabled + len, sizeof (enabled) - len, "%s+%s", len ? " " : "", controllers [idx]);
+    }
+    enabled [len] = '\0';
+
+    return len == 0 || write_file (dir, "cgroup.subtree_control", enabled);
+}
+
+static void
+apply (const char *dir, const char *settings)
+{
+    char buf [1024], *key, *value, *next;
+
+    if ( settings == NULL )
+        return;
+
+    snprintf (buf, sizeof (buf), "%s", settings);
+    for ( key = buf; *key != '\0'; key = next ) {
+        while ( *key == ' ' || *key == '\t' )
+            key++;
+
+        for ( next = key; *next != '\0' && *next != ' ' && *next != '\t'; next++ )
+            ;  /* NOP */
+        if ( *next != '\0' )
+            *next++ = '\0';
+
+        value = strchr (key, '=');
+        if ( value == NULL || strchr (key, '/') != NULL ) {
+            if ( *key != '\0' )
+                errorx ("invalid cgroup setting '%s'", key);
+            continue;
+        }
+        *value++ = '\0';
+
+        if ( write_file (dir, key, value) )
+            debugx ("cgroup: %s/%s = %s", dir, key, value);
+        else
+            error ("could not set %s to %s in %s", key, value, dir);
+    }
+}
+
+static void
+leave (void)
+{
+    char dir [PATH_MAX];
+
+    /* Back to where we came from, our leaf goes away with the rest */
+    write_file (origin, "cgroup.procs", "0");
+    if ( join (dir, base, "supervisor") )
+        rmdir (dir);
+}
+
+static void
+make_trees (void)
+{
+    char dir [PATH_MAX];
+    const char *settings;
+    int idx;
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( !join (dir, trees, tree_names [idx]) || (mkdir (dir, 0755) == -1 && errno != EEXIST) ) {
+            error ("could not create cgroup %s", dir);
+            continue;
+        }
+
+        settings = idx == CgroupServer ? u_server_cgroup : u_client_cgroup;
+        apply (dir, settings);
+
+        fds [idx] = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    debugx ("cgroups under %s, controllers '%s'", trees, enabled);
+}
+
+/* In a seat child, below the base the supervisor set up */
+static void
+seat_trees (void)
+{
+    if ( !join (trees, base, seat_name ()) || (mkdir (trees, 0755) == -1 && errno != EEXIST) ) {
+        error ("could not create cgroup %s", trees);
+        *base = '\0';
+        return;
+    }
+    in_seat = True;
+
+    /* Nobody lives in it, so this works right away */
+    if ( !enable_controllers (trees) ) {
+        error ("could not enable controllers in %s", trees);
+        rmdir (trees);
+        *base = '\0';
+        return;
+    }
+    make_trees ();
+}
+
+/*
+ * Create and set up the server and client cgroups; call it before either
+ * is started. With seats the supervisor calls it before seat_fork (), and
+ * every seat child again for its own subtree.
+ */
+void
+cgroup_setup (void)
+{
+    char own [PATH_MAX], dir [PATH_MAX];
+    const char *root;
+
+    if ( u_cgroup == NULL )
+        return;
+
+    if ( *base != '\0' ) {
+        if ( seat_name () != NULL && !in_seat )
+            seat_trees ();
+        return;
+    }
+
+    root = find_root ();
+    if ( root == NULL ) {
+        debugx ("no cgroup v2 hierarchy");
+        return;
+    }
+
+    if ( !own_cgroup (own, sizeof (own)) ) {
+        debugx ("could not read %s", CGROUP_SELF);
+        return;
+    }
+    if ( snprintf (origin, sizeof (origin), "%s%s", root, own) >= (int) sizeof (origin) )
+        return;
+
+    /* Below the root, whatever the config file says */
+    if ( strcmp (u_cgroup, "auto") != 0 &&
+         snprintf (own, sizeof (own), "%s%s", *u_cgroup == '/' ? "" : "/", u_cgroup) >= (int) sizeof (own) ) {
+        errorx ("cgroup '%s' is too long", u_cgroup);
+        return;
+    }
+
+    if ( strspn (own, "/") == strlen (own) ) {
+        /* Nothing was delegated to us there */
+        debugx ("not using the root cgroup");
+        return;
+    }
+
+    if ( snprintf (base, sizeof (base), "%s%s", root, own) >= (int) sizeof (base) ) {
+        *base = '\0';
+        return;
+    }
+
+    created = mkdir (base, 0755) == 0;
+    if ( !join (dir, base, "supervisor") || (mkdir (dir, 0755) == -1 && errno != EEXIST) || !write_file (dir, "cgroup.procs", "0") ) {
+        error ("could not move to cgroup %s", dir);
+        goto fail;
+    }
+
+    /* Fails as long as others live next to us */
+    if ( !enable_controllers (base) ) {
+        error ("could not enable controllers in %s, it needs to be delegated to xinit alone", base);
+        leave ();
+        goto fail;
+    }
+
+    /* The supervisor of seats runs neither server nor client */
+    if ( seat_count () != 0 ) {
+        if ( seat_name () != NULL )
+            seat_trees ();
+        return;
+    }
+
+    snprintf (trees, sizeof (trees), "%s", base);
+    make_trees ();
+    return;
+
+fail:
+
+    if ( created )
+        rmdir (base);
+    *base = '\0';
+}
+
+/* For Spawn.cgroup, -1 when not in use */
+int
+cgroup_fd (CgroupTree tree)
+{
+    return fds [tree];
+}
+
+/*
+ * Undo what cgroup_setup () did, as far as the cgroups are empty: what
+ * the client left running keeps its cgroup, and ours with it. A seat
+ * child only removes its own subtree, the base is the supervisor's.
+ */
+void
+cgroup_release (void)
+{
+    char dir [PATH_MAX], off [32];
+    int idx, len = 0;
+
+    if ( *base == '\0' )
+        return;
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( fds [idx] != -1 )
+            close (fds [idx]);
+        fds [idx] = -1;
+
+        if ( *trees == '\0' )
+            continue;
+
+        if ( join (dir, trees, tree_names [idx]) && rmdir (dir) == -1 && errno != ENOENT ) {
+            debug ("cgroup %s stays", dir);
+            goto quit;
+        }
+    }
+
+    if ( in_seat ) {
+        rmdir (trees);
+        goto quit;
+    }
+
+    /* "+cpu +io" becomes "-cpu -io" */
+    len = snprintf (off, sizeof (off), "%s", enabled);
+    for ( idx = 0; idx < len; idx++ ) {
+        if ( off [idx] == '+' )
+            off [idx] = '-';
+    }
+    if ( len != 0 && !write_file (base, "cgroup.subtree_control", off) )
+        goto quit;
+
+    leave ();
+    if ( created )
+        rmdir (base);
+
+quit:
+
+    *base = '\0';
+    *trees = '\0';
+    in_seat = False;
+}
@@ -0,0 +1,299 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* fstatat */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>  /* major, minor */
+#include <linux/vt.h>  /* MAX_NR_CONSOLES */
+
+#include "util.h"
+#include "devices.h"
+
+
+/* udev keeps the ID_SEAT tag of each device here; untagged means seat0 */
+#define UDEV_DATA     "/run/udev/data/c%u:%u"
+#define DEFAULT_SEAT  "seat0"
+
+
+typedef struct {
+    const char *sys_dir;    /* listing of the devices present */
+    const char *dev_dir;    /* where the nodes live, also the fallback listing */
+    const char *prefix;
+} DevSource;
+
+
+/* Indexed by DevClass */
+static const DevSource sources [DevClassCount] = {
+    { "/sys/class/graphics", "/dev",       "fb" },
+    { "/sys/class/drm",      "/dev/dri",   "card" },
+    { "/sys/class/tty",      "/dev",       "tty" },
+    { "/sys/class/input",    "/dev/input", "event" }
+};
+
+static Device *devices = NULL;
+static int ndevices = 0;
+static int scanned = False;
+
+
+/*
+ * Code
+ */
+
+static int
+parse_index (const char *name, const char *prefix)
+{
+    const char *p;
+    int len, index = 0;
+
+    len = strlen (prefix);
+    if ( strncmp (name, prefix, len) != 0 )
+        return -1;
+
+    /* "card0" but not "card0-HDMI-A-1", "tty1" but not "ttyS0" */
+    p = name + len;
+    if ( *p == '\0' )
+        return -1;
+
+    for ( ; *p != '\0'; p++ ) {
+        if ( *p < '0' || *p > '9' || index > 0xFFF )
+            return -1;
+
+        index = index * 10 + *p - '0';
+    }
+    return index;
+}
+
+static int
+add_device (DevClass cls, int index, struct stat *st)
+{
+    Device *dev;
+
+    if ( (ndevices & 15) == 0 ) {
+        dev = realloc (devices, (ndevices + 16) * sizeof (Device));
+        if ( dev == NULL ) {
+            error_no_memory ();
+            return False;
+        }
+        devices = dev;
+    }
+
+    dev = devices + ndevices++;
+    dev->cls = cls;
+    dev->index = index;
+    dev->mode = st->st_mode;
+    dev->uid = st->st_uid;
+    dev->gid = st->st_gid;
+    dev->rdev = st->st_rdev;
+    dev->ino = st->st_ino;
+    dev->ctime = st->st_ctime;
+    return True;
+}
+
+static int
+scan_class (DevClass cls)
+{
+    const DevSource *src = sources + cls;
+    struct dirent *ent;
+    struct stat st;
+    DIR *dir;
+    int devfd, index, result = True;
+
+    devfd = open (src->dev_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( devfd == -1 ) {
+        debug ("could not open %s", src->dev_dir);
+        return True;  /* no such devices */
+    }
+
+    /* sysfs only lists what the kernel knows about; fall back to /dev */
+    dir = opendir (src->sys_dir);
+    if ( dir == NULL )
+        dir = fdopendir (dup (devfd));
+
+    if ( dir == NULL ) {
+        debug ("could not list %s", src->dev_dir);
+        close (devfd);
+        return True;
+    }
+
+    while ( (ent = readdir (dir)) != NULL ) {
+        index = parse_index (ent->d_name, src->prefix);
+        /* tty0 and every VT the kernel can have, VT_OPENQRY may hand out
+         * one VT_GETSTATE doesn't report */
+        if ( index < 0 || (cls == DevTty && index > MAX_NR_CONSOLES) )
+            continue;
+
+        /* The only syscall per present device */
+        if ( fstatat (devfd, ent->d_name, &st, 0) == -1 ) {
+            debug ("could not read stats for %s/%s", src->dev_dir, ent->d_name);
+            continue;
+        }
+        if ( !S_ISCHR (st.st_mode) )
+            continue;
+
+        if ( !add_device (cls, index, &st) ) {
+            result = False;
+            break;
+        }
+    }
+
+    closedir (dir);
+    close (devfd);
+    return result;
+}
+
+static int
+compare_devices (const void *a, const void *b)
+{
+    const Device *da = a, *db = b;
+
+    if ( da->cls != db->cls )
+        return da->cls - db->cls;
+
+    return da->index - db->index;
+}
+
+int
+devices_scan (void)
+{
+    long long start;
+    int cls;
+
+    if ( scanned )
+        return True;
+
+    start = mono_us ();
+    for ( cls = 0; cls < DevClassCount; cls++ ) {
+        if ( !scan_class (cls) )
+            return False;
+    }
+
+    /* Probes walk the devices in ascending index order */
+    qsort (devices, ndevices, sizeof (Device), compare_devices);
+    scanned = True;
+
+    debugx ("device inventory: %d devices in %lld us", ndevices, mono_us () - start);
+    return True;
+}
+
+Device *
+devices_class (DevClass cls, int *count)
+{
+    int first, last;
+
+    for ( first = 0; first < ndevices && devices [first].cls != cls; first++ )
+        ;  /* NOP */
+
+    for ( last = first; last < ndevices && devices [last].cls == cls; last++ )
+        ;  /* NOP */
+
+    *count = last - first;
+    return devices + first;
+}
+
+Device *
+devices_find (DevClass cls, int index)
+{
+    Device *dev;
+    int count;
+
+    for ( dev = devices_class (cls, &count); count != 0; dev++, count-- ) {
+        if ( dev->index == index )
+            return dev;
+    }
+    return NULL;
+}
+
+void
+devices_path (const Device *dev, char *buf, int len)
+{
+    const DevSource *src = sources + dev->cls;
+
+    snprintf (buf, len, "%s/%s%d", src->dev_dir, src->prefix, dev->index);
+}
+
+static void
+udev_seat (const Device *dev, char *seat, int len)
+{
+    char path [64], line [256], *end;
+    FILE *data;
+
+    snprintf (seat, len, "%s", DEFAULT_SEAT);
+    snprintf (path, sizeof (path), UDEV_DATA, major (dev->rdev), minor (dev->rdev));
+
+    data = fopen (path, "r");
+    if ( data == NULL )
+        return;
+
+    while ( fgets (line, sizeof (line), data) != NULL ) {
+        if ( strncmp (line, "E:ID_SEAT=", 10) != 0 )
+            continue;
+
+        end = strchr (line, '\n');
+        if ( end == NULL )
+            end = line + strlen (line);
+
+        if ( end - (line + 10) < len ) {
+            memcpy (seat, line + 10, end - (line + 10));
+            seat [end - (line + 10)] = '\0';
+        }
+        break;
+    }
+    fclose (data);
+}
+
+/*
+ * Drop the fb, drm and input devices udev assigned to other seats, so that
+ * the probes only look at those of 'seat'. VTs belong to every seat.
+ */
+void
+devices_keep_seat (const char *seat)
+{
+    char name [64];
+    int idx, kept = 0;
+
+    for ( idx = 0; idx < ndevices; idx++ ) {
+        if ( devices [idx].cls != DevTty ) {
+            udev_seat (devices + idx, name, sizeof (name));
+            if ( strcmp (name, seat) != 0 )
+                continue;
+        }
+        devices [kept++] = devices [idx];
+    }
+
+    debugx ("device inventory: %d of %d devices belong to %s", kept, ndevices, seat);
+    ndevices = kept;
+}
+
+void
+devices_free (void)
+{
+    free (devices);
+    devices = NULL;
+    ndevices = 0;
+    scanned = False;
+}
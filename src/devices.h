@@ -0,0 +1,57 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _DEVICES_H
+#define _DEVICES_H
+
+#include <sys/types.h>
+
+
+/* Longest node is "/dev/input/event%d" */
+#define DEVICE_PATH_LENGTH  32
+
+typedef enum {
+    DevFb,            /* /dev/fb%d */
+    DevDrm,           /* /dev/dri/card%d */
+    DevTty,           /* /dev/tty%d, tty0 and VTs 1-63 */
+    DevEvent,         /* /dev/input/event%d */
+    DevClassCount
+} DevClass;
+
+/* One character device node; the inventory keeps them sorted by class
+ * and index */
+typedef struct {
+    unsigned short cls;
+    unsigned short index;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    dev_t rdev;
+    ino_t ino;
+    time_t ctime;     /* changes with chmod/chown, unlike mtime on I/O */
+} Device;
+
+
+int devices_scan (void);
+Device * devices_class (DevClass cls, int *count);
+Device * devices_find (DevClass cls, int index);
+void devices_keep_seat (const char *seat);
+void devices_path (const Device *dev, char *buf, int len);
+void devices_free (void);
+
+
+#endif  /* _DEVICES_H */
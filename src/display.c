@@ -0,0 +1,273 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>  /* CHAR_BIT */
+#include <signal.h>  /* kill */
+#include <sys/file.h>  /* flock */
+#include <sys/stat.h>
+#include <time.h>
+
+#include "util.h"
+#include "display.h"
+
+
+#define SOCKET_DIR    "/tmp/.X11-unix"
+#define LOCK_PATH     "/tmp/.X%d-lock"
+#define LOCK_TEMP     "/tmp/.X%d-lock.%d"
+#define LOCK_LENGTH   (sizeof (LOCK_TEMP) + 16)
+#define LOCK_SIZE     11      /* "%10d\n" */
+#define LOCK_GRACE    5       /* s a short lock may still be written to */
+
+#define DISPLAY_MAX   1024
+#define LONG_BITS     (sizeof (unsigned long) * CHAR_BIT)
+
+
+/*
+ * Locks look like the X server's own: the pid as "%10d\n", written to a
+ * file of our own and link ()ed into place so nobody sees it half done.
+ * The server refuses a lock held by a live process, so its child hands
+ * ours over right before exec, see display_child ().
+ */
+static unsigned long bitmap [DISPLAY_MAX / LONG_BITS];
+static int claimed = -1;
+static char lock [LOCK_LENGTH];       /* path of the claimed one */
+static char owner [LOCK_SIZE + 1];    /* and what it holds */
+
+
+/*
+ * Code
+ */
+
+static int
+bit_test (int num)
+{
+    return (bitmap [num / LONG_BITS] >> (num % LONG_BITS)) & 1;
+}
+
+static void
+bit_set (int num)
+{
+    bitmap [num / LONG_BITS] |= 1UL << (num % LONG_BITS);
+}
+
+static int
+scan_sockets (void)
+{
+    struct dirent *ent;
+    DIR *dir;
+    char *end;
+    long num;
+    int count = 0;
+
+    /* One readdir instead of a stat per display */
+    dir = opendir (SOCKET_DIR);
+    if ( dir == NULL )
+        return 0;
+
+    while ( (ent = readdir (dir)) != NULL ) {
+        if ( ent->d_name [0] != 'X' || ent->d_name [1] < '0' || ent->d_name [1] > '9' )
+            continue;
+
+        num = strtol (ent->d_name + 1, &end, 10);
+        if ( *end == '\0' && num < DISPLAY_MAX ) {
+            bit_set (num);
+            count++;
+        }
+    }
+    closedir (dir);
+    return count;
+}
+
+/* 0 for a lock shorter than the server would write */
+static pid_t
+read_owner (int fd)
+{
+    char buf [LOCK_SIZE + 1];
+    ssize_t count;
+
+    count = pread (fd, buf, LOCK_SIZE, 0);
+    if ( count != LOCK_SIZE )
+        return 0;
+
+    buf [count] = '\0';
+    return (pid_t) atoi (buf);
+}
+
+static int
+remove_stale (const char *path)
+{
+    struct stat fst, pst;
+    pid_t pid;
+    int fd, result = False;
+
+    fd = open (path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if ( fd == -1 )
+        return errno == ENOENT;  /* somebody removed it meanwhile */
+
+    /* Serialize with other launchers cleaning up the same lock */
+    flock (fd, LOCK_EX);
+
+    /* A short lock is bogus to the server, but a launcher that doesn't
+     * link () its lock may not be done writing it yet */
+    pid = read_owner (fd);
+    if ( pid > 0 && (kill (pid, 0) == 0 || errno != ESRCH) )
+        goto quit;
+    if ( pid <= 0 && (fstat (fd, &fst) != 0 || time (NULL) - fst.st_mtime < LOCK_GRACE) )
+        goto quit;
+
+    /* Only unlink when the path still refers to the file we checked */
+    if ( fstat (fd, &fst) == 0 && stat (path, &pst) == 0 &&
+         fst.st_ino == pst.st_ino && fst.st_dev == pst.st_dev ) {
+        debugx ("removing stale lock %s (pid %d)", path, pid);
+        result = unlink (path) == 0;
+    }
+
+quit:
+
+    close (fd);
+    return result;
+}
+
+static int
+try_claim (int num)
+{
+    char path [LOCK_LENGTH], temp [LOCK_LENGTH];
+    int fd, result, err;
+
+    snprintf (path, sizeof (path), LOCK_PATH, num);
+    snprintf (temp, sizeof (temp), LOCK_TEMP, num, (int) getpid ());
+    snprintf (owner, sizeof (owner), "%10d\n", (int) getpid ());
+
+    /* A leftover would be one of ours from an earlier process */
+    unlink (temp);
+    fd = open (temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0444);
+    if ( fd == -1 ) {
+        error ("could not create %s", temp);
+        return DIE;
+    }
+    if ( write (fd, owner, LOCK_SIZE) != LOCK_SIZE ) {
+        error ("could not write %s", temp);
+        close (fd);
+        unlink (temp);
+        return DIE;
+    }
+    close (fd);
+
+    result = link (temp, path) == 0;
+    err = errno;
+    if ( !result && err == EEXIST && remove_stale (path) ) {
+        result = link (temp, path) == 0;
+        err = errno;
+    }
+    unlink (temp);
+
+    if ( !result && err != EEXIST ) {
+        errno = err;
+        error ("could not create %s", path);
+        return DIE;
+    }
+
+    if ( result )
+        snprintf (lock, sizeof (lock), "%s", path);
+    return result;
+}
+
+int
+display_claim (void)
+{
+    char display [16];
+    int num, tries, result;
+
+    debugx ("%d display sockets in %s", scan_sockets (), SOCKET_DIR);
+
+    for ( num = 0, tries = 0; tries < DISPLAY_MAX; tries++, num = (num + 1) % DISPLAY_MAX ) {
+        if ( bit_test (num) )
+            continue;
+
+        result = try_claim (num);
+        if ( result == DIE )
+            return False;
+
+        if ( result ) {
+            claimed = num;
+            snprintf (display, sizeof (display), ":%d", num);
+            debugx ("claimed display %s after %d tries", display, tries + 1);
+            return set_display (display);
+        }
+
+        /* Lost a race: spread out instead of following everybody else */
+        bit_set (num);
+        if ( tries == 0 )
+            num = (getpid () % (DISPLAY_MAX - 1));
+    }
+
+    errorx ("could not find a free display");
+    return False;
+}
+
+/*
+ * In the server's child right before exec: the server would take our
+ * lock for a running server, so it goes while it is still ours.
+ * Async-signal-safe.
+ */
+void
+display_child (void)
+{
+    char buf [LOCK_SIZE];
+    int fd, ours;
+
+    if ( claimed < 0 )
+        return;
+
+    fd = open (lock, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if ( fd == -1 )
+        return;
+
+    ours = read (fd, buf, LOCK_SIZE) == LOCK_SIZE && memcmp (buf, owner, LOCK_SIZE) == 0;
+    close (fd);
+    if ( ours )
+        unlink (lock);
+}
+
+void
+display_release (void)
+{
+    int fd;
+
+    if ( claimed < 0 )
+        return;
+
+    /* Still ours when no server got to run */
+    fd = open (lock, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if ( fd != -1 ) {
+        if ( read_owner (fd) == getpid () )
+            unlink (lock);
+        close (fd);
+    }
+    claimed = -1;
+}
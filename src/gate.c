@@ -0,0 +1,261 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* pipe2 */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>  /* PATH_MAX */
+#include <elf.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "gate.h"
+
+
+#ifndef GATE_PRELOAD
+# define GATE_PRELOAD  "/usr/local/lib/xinit/xinit-gate.so"  /* make bench points it elsewhere */
+#endif
+
+#define GATE_MAX  4096  /* bytes of environment handed over */
+
+
+/*
+ * With 'early-client' the client is forked before the server and does
+ * all it can on its own, then blocks here. Once the server is ready the
+ * parent sends what only it knows ("DISPLAY=:1\0WINDOWPATH=7\0") and
+ * closes the pipe; EOF without a message means the server never came up.
+ *
+ * Where it can, the client does not block before exec but right after
+ * it: the session is exec'd with GATE_PRELOAD preloaded and LD_BIND_NOW
+ * set, so ld.so maps and binds the session binary and all its libraries
+ * while the server starts, and only then does the library's constructor
+ * wait on the gate (see src/preload/gate.c). A static or setuid program
+ * would run without waiting, so those wait before exec.
+ */
+static int gatefd [2] = { -1, -1 };
+static char envbuf [GATE_MAX + 1];  /* putenv () keeps pointers into it */
+
+
+/*
+ * Code
+ */
+
+static void
+close_end (int idx)
+{
+    if ( gatefd [idx] != -1 ) {
+        close (gatefd [idx]);
+        gatefd [idx] = -1;
+    }
+}
+
+int
+gate_prepare (void)
+{
+    if ( pipe2 (gatefd, O_CLOEXEC) == -1 ) {
+        error ("could not create client gate");
+        gatefd [0] = gatefd [1] = -1;
+        return False;
+    }
+    return True;
+}
+
+void
+gate_child (void)
+{
+    close_end (1);
+}
+
+void
+gate_parent (void)
+{
+    close_end (0);
+}
+
+/* The ELF interpreter of 'path', or that of a script's interpreter */
+static int
+is_dynamic (const char *path, int depth)
+{
+    unsigned char buf [PATH_MAX + 2];
+    Elf64_Ehdr *eh64 = (Elf64_Ehdr *) buf;
+    Elf32_Ehdr *eh32 = (Elf32_Ehdr *) buf;
+    Elf64_Phdr ph64;
+    Elf32_Phdr ph32;
+    struct stat st;
+    char *interp, *end;
+    ssize_t count;
+    int fd, idx, num, result = False;
+    off_t off;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 )
+        return False;
+
+    /* ld.so ignores LD_PRELOAD paths for setuid programs */
+    count = read (fd, buf, sizeof (buf) - 1);
+    if ( fstat (fd, &st) == -1 || (st.st_mode & (S_ISUID | S_ISGID)) || count < 4 )
+        goto quit;
+
+    if ( buf [0] == '#' && buf [1] == '!' && depth == 0 ) {
+        buf [count] = '\0';
+        for ( interp = (char *) buf + 2; *interp == ' ' || *interp == '\t'; interp++ )
+            ;  /* NOP */
+        end = interp + strcspn (interp, " \t\n");
+        *end = '\0';
+        result = *interp == '/' && is_dynamic (interp, depth + 1);
+        goto quit;
+    }
+
+    if ( memcmp (buf, ELFMAG, SELFMAG) != 0 )
+        goto quit;
+
+    if ( buf [EI_CLASS] == ELFCLASS64 && count >= (ssize_t) sizeof (Elf64_Ehdr) ) {
+        off = eh64->e_phoff;
+        num = eh64->e_phnum;
+        for ( idx = 0; idx < num && !result; idx++, off += eh64->e_phentsize ) {
+            if ( pread (fd, &ph64, sizeof (ph64), off) != sizeof (ph64) )
+                break;
+            result = ph64.p_type == PT_INTERP;
+        }
+    } else if ( buf [EI_CLASS] == ELFCLASS32 && count >= (ssize_t) sizeof (Elf32_Ehdr) ) {
+        off = eh32->e_phoff;
+        num = eh32->e_phnum;
+        for ( idx = 0; idx < num && !result; idx++, off += eh32->e_phentsize ) {
+            if ( pread (fd, &ph32, sizeof (ph32), off) != sizeof (ph32) )
+                break;
+            result = ph32.p_type == PT_INTERP;
+        }
+    }
+
+quit:
+
+    close (fd);
+    return result;
+}
+
+static int
+save_env (const char *name, const char *saved)
+{
+    const char *value = getenv (name);
+
+    return setenv (saved, value != NULL ? value : "", True) == 0;
+}
+
+/*
+ * In the client, after it took the user's ids: True when the gate is left
+ * to the preloaded library for 'path' to wait on, False when gate_wait ()
+ * has to be called before exec.
+ */
+int
+gate_handoff (const char *path)
+{
+    char buf [PATH_MAX + 32], fdbuf [12];
+    const char *preload;
+
+    /* A secure-mode exec drops LD_PRELOAD */
+    if ( getuid () != geteuid () || getgid () != getegid () ||
+         access (GATE_PRELOAD, R_OK) != 0 || !is_dynamic (path, 0) )
+        return False;
+
+    /* Restored by the library, nothing the session starts sees it */
+    preload = getenv ("LD_PRELOAD");
+    snprintf (buf, sizeof (buf), "%s%s%s", GATE_PRELOAD, preload != NULL ? " " : "", preload != NULL ? preload : "");
+    snprintf (fdbuf, sizeof (fdbuf), "%d", gatefd [0]);
+
+    if ( !save_env ("LD_PRELOAD", "XINIT_GATE_PRELOAD") || !save_env ("LD_BIND_NOW", "XINIT_GATE_BIND_NOW") ||
+         setenv ("LD_PRELOAD", buf, True) != 0 || setenv ("LD_BIND_NOW", "1", True) != 0 ||
+         setenv ("XINIT_GATE_FD", fdbuf, True) != 0 || fcntl (gatefd [0], F_SETFD, 0) == -1 ) {
+        error ("could not hand the client gate over");
+        return False;
+    }
+    return True;
+}
+
+/* In the client: block until released, then take over the environment */
+int
+gate_wait (void)
+{
+    char *buf = envbuf, *p, *end;
+    ssize_t count;
+    int len = 0;
+
+    while ( len < GATE_MAX ) {
+        count = read (gatefd [0], buf + len, GATE_MAX - len);
+        if ( count == -1 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+            break;
+
+        len += count;
+    }
+    close_end (0);
+
+    if ( len == 0 ) {
+        debugx ("client gate closed, the server did not start");
+        return False;
+    }
+
+    buf [len] = '\0';
+    for ( p = buf, end = buf + len; p < end; p += strlen (p) + 1 ) {
+        if ( strchr (p, '=') != NULL && putenv (p) != 0 ) {
+            error ("unable to set %s", p);
+            return False;
+        }
+    }
+    return True;
+}
+
+/* In the parent: hand 'env' ("NAME=value" strings) over and release */
+int
+gate_release (const char * const *env)
+{
+    char buf [GATE_MAX];
+    int len = 0, size, result = True;
+
+    for ( ; *env != NULL; env++ ) {
+        size = strlen (*env) + 1;
+        if ( len + size > GATE_MAX ) {
+            errorx ("client environment too large");
+            result = False;
+            break;
+        }
+        memcpy (buf + len, *env, size);
+        len += size;
+    }
+
+    if ( result && write (gatefd [1], buf, len) != len ) {
+        error ("could not release the client");
+        result = False;
+    }
+    close_end (1);
+    return result;
+}
+
+void
+gate_close (void)
+{
+    close_end (0);
+    close_end (1);
+}
@@ -0,0 +1,392 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* getgrouplist */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <pwd.h>  /* getpwuid_r */
+#include <grp.h>  /* getgrouplist */
+
+#include "util.h"
+#include "cache.h"
+#include "ident.h"
+
+
+#define IDENT_CACHE   "ident.%d"
+#define GROUPS_GUESS  64      /* getgrouplist () is called again only for more */
+#define PWBUF_SIZE    16384
+
+
+typedef struct {
+    char *name;
+    char *home;
+    gid_t *groups;
+    int ngroups;
+} Identity;
+
+/* Shared between main and the NSS thread; whoever comes last frees it */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uid_t uid;
+    int done;
+    int abandoned;
+    int ok;
+    Identity id;
+} Lookup;
+
+
+static Identity ident = { NULL, NULL, NULL, 0 };
+
+
+/*
+ * Code
+ */
+
+static void
+identity_clear (Identity *id)
+{
+    free (id->name);
+    free (id->home);
+    free (id->groups);
+    memset (id, 0, sizeof (*id));
+}
+
+static int
+own_groups (Identity *id)
+{
+    gid_t gid = getgid ();
+    int count, idx;
+
+    count = getgroups (0, NULL);
+    if ( count < 0 ) {
+        debug ("getgroups error");
+        return False;
+    }
+
+    /* +1 for the primary group, getgroups () may leave it out */
+    id->groups = x_malloc ((count + 1) * sizeof (gid_t));
+    if ( id->groups == NULL )
+        return False;
+
+    count = getgroups (count, id->groups);
+    if ( count < 0 ) {
+        debug ("getgroups error");
+        return False;
+    }
+
+    for ( idx = 0; idx < count && id->groups [idx] != gid; idx++ )
+        ;  /* NOP */
+
+    if ( idx == count )
+        id->groups [count++] = gid;
+
+    id->ngroups = count;
+    return True;
+}
+
+static int
+lookup_nss (uid_t uid, Identity *id)
+{
+    struct passwd pw, *result;
+    char *buf;
+    int count = GROUPS_GUESS;
+
+    buf = malloc (PWBUF_SIZE);
+    if ( buf == NULL )
+        return False;
+
+    if ( getpwuid_r (uid, &pw, buf, PWBUF_SIZE, &result) != 0 || result == NULL ) {
+        free (buf);
+        return False;
+    }
+
+    id->name = strdup (pw.pw_name);
+    id->home = strdup (pw.pw_dir);
+    id->groups = malloc (count * sizeof (gid_t));
+
+    /* A single round trip for most users */
+    if ( id->name != NULL && id->groups != NULL &&
+         getgrouplist (pw.pw_name, pw.pw_gid, id->groups, &count) == -1 ) {
+        free (id->groups);
+        id->groups = malloc (count * sizeof (gid_t));
+        if ( id->groups != NULL && getgrouplist (pw.pw_name, pw.pw_gid, id->groups, &count) == -1 )
+            count = -1;
+    }
+    free (buf);
+
+    if ( id->name == NULL || id->home == NULL || id->groups == NULL || count < 0 ) {
+        identity_clear (id);
+        return False;
+    }
+    id->ngroups = count;
+    return True;
+}
+
+static void
+lookup_free (Lookup *lookup)
+{
+    identity_clear (&lookup->id);
+    pthread_cond_destroy (&lookup->cond);
+    pthread_mutex_destroy (&lookup->lock);
+    free (lookup);
+}
+
+static void *
+lookup_run (void *data)
+{
+    Lookup *lookup = data;
+    int ok, abandoned;
+
+    ok = lookup_nss (lookup->uid, &lookup->id);
+
+    pthread_mutex_lock (&lookup->lock);
+    lookup->ok = ok;
+    lookup->done = True;
+    abandoned = lookup->abandoned;
+    pthread_cond_signal (&lookup->cond);
+    pthread_mutex_unlock (&lookup->lock);
+
+    /* main gave up on us */
+    if ( abandoned )
+        lookup_free (lookup);
+
+    return NULL;
+}
+
+static int
+lookup_deadline (uid_t uid, Identity *id)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+    struct timespec ts;
+    Lookup *lookup;
+    int ok, rc = 0;
+
+    lookup = calloc (1, sizeof (Lookup));
+    if ( lookup == NULL ) {
+        error_no_memory ();
+        return False;
+    }
+    lookup->uid = uid;
+
+    pthread_mutex_init (&lookup->lock, NULL);
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (&lookup->cond, &attr);
+    pthread_condattr_destroy (&attr);
+
+    if ( pthread_create (&thread, NULL, lookup_run, lookup) != 0 ) {
+        /* No deadline then, but still an answer */
+        lookup_run (lookup);
+    } else
+        pthread_detach (thread);
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += u_nss_timeout / 1000;
+    ts.tv_nsec += (long) (u_nss_timeout % 1000) * 1000000;
+    if ( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock (&lookup->lock);
+    while ( !lookup->done && rc != ETIMEDOUT )
+        rc = pthread_cond_timedwait (&lookup->cond, &lookup->lock, &ts);
+
+    if ( !lookup->done ) {
+        lookup->abandoned = True;
+        pthread_mutex_unlock (&lookup->lock);
+        debugx ("NSS lookup for uid %d exceeded %d ms", (int) uid, u_nss_timeout);
+        return False;
+    }
+    pthread_mutex_unlock (&lookup->lock);
+
+    ok = lookup->ok;
+    if ( ok ) {
+        *id = lookup->id;
+        memset (&lookup->id, 0, sizeof (lookup->id));
+    }
+    lookup_free (lookup);
+    return ok;
+}
+
+static void
+save_cache (uid_t uid, const Identity *id)
+{
+    char name [32], *buf;
+    int idx, len, size;
+
+    size = strlen (id->name) + strlen (id->home) + 12 * (id->ngroups + 1) + 4;
+    buf = x_malloc (size);
+    if ( buf == NULL )
+        return;
+
+    len = snprintf (buf, size, "%s\n%s\n", id->name, id->home);
+    for ( idx = 0; idx < id->ngroups; idx++ )
+        len += snprintf (buf + len, size - len, idx ? " %d" : "%d", (int) id->groups [idx]);
+    snprintf (buf + len, size - len, "\n");
+
+    snprintf (name, sizeof (name), IDENT_CACHE, (int) uid);
+    cache_save (name, buf);
+    free (buf);
+}
+
+static int
+load_cache (uid_t uid, Identity *id)
+{
+    char name [32], *data, *home, *groups, *end, *p;
+    int count, size;
+    long gid;
+
+    snprintf (name, sizeof (name), IDENT_CACHE, (int) uid);
+    data = cache_load (name);
+    if ( data == NULL )
+        return False;
+
+    /* name \n home \n gid gid ... \n */
+    home = strchr (data, '\n');
+    groups = home != NULL ? strchr (home + 1, '\n') : NULL;
+    if ( groups == NULL )
+        goto quit;
+
+    *home++ = '\0';
+    *groups++ = '\0';
+
+    /* Every gid takes a digit and a separator, the last maybe no separator */
+    size = strlen (groups) / 2 + 1;
+    id->groups = x_malloc (size * sizeof (gid_t));
+    if ( id->groups == NULL )
+        goto quit;
+
+    for ( p = groups, count = 0; count < size; p = end ) {
+        gid = strtol (p, &end, 10);
+        if ( end == p )
+            break;
+        id->groups [count++] = gid;
+    }
+    id->ngroups = count;
+    id->name = s_dup (data);
+    id->home = s_dup (home);
+
+    if ( count != 0 && id->name != NULL && id->home != NULL ) {
+        free (data);
+        return True;
+    }
+    identity_clear (id);
+
+quit:
+
+    free (data);
+    return False;
+}
+
+static void
+debug_groups (void)
+{
+    char buf [256];
+    int idx, len = 0;
+
+    buf [0] = '\0';
+    for ( idx = 0; idx < ident.ngroups && len < (int) sizeof (buf) - 12; idx++ )
+        len += snprintf (buf + len, sizeof (buf) - len, " %d", (int) ident.groups [idx]);
+
+    debugx ("groups:%s", buf);
+}
+
+/*
+ * Resolve home and group list of 'uid' once for the whole run. Our own
+ * credentials and $HOME are used when they apply, NSS is only asked for
+ * what is missing and only for 'nss-timeout' ms; the last good NSS answer
+ * is kept in the cache for when it is slow.
+ */
+int
+ident_resolve (uid_t uid)
+{
+    Identity found = { NULL, NULL, NULL, 0 };
+    const char *source = "process";
+    long long start;
+    char *env;
+
+    start = mono_us ();
+    identity_clear (&ident);
+
+    env = getenv ("HOME");
+    if ( env != NULL && *env != '\0' && (ident.home = s_dup (env)) == NULL )
+        return False;
+
+    /* The session's groups are already in our credentials */
+    if ( uid == getuid () && !own_groups (&ident) )
+        return False;
+
+    if ( ident.home == NULL || ident.groups == NULL ) {
+        if ( lookup_deadline (uid, &found) ) {
+            save_cache (uid, &found);
+            source = "nss";
+        } else if ( load_cache (uid, &found) )
+            source = "cache";
+        else if ( ident.groups == NULL ) {
+            errorx ("could not resolve user %d", (int) uid);
+            return False;
+        }
+
+        /* Keep what we had, take the rest */
+        if ( ident.home == NULL ) {
+            ident.home = found.home;
+            found.home = NULL;
+        }
+        if ( ident.groups == NULL ) {
+            ident.groups = found.groups;
+            ident.ngroups = found.ngroups;
+            found.groups = NULL;
+        }
+        identity_clear (&found);
+    }
+
+    debugx ("user %d: home=%s, %d groups from %s in %lld us", (int) uid,
+        ident.home != NULL ? ident.home : "(none)", ident.ngroups, source, mono_us () - start);
+    debug_groups ();
+    return True;
+}
+
+const char *
+ident_home (void)
+{
+    return ident.home;
+}
+
+gid_t *
+ident_groups (int *ngroups)
+{
+    *ngroups = ident.ngroups;
+    return ident.groups;
+}
+
+void
+ident_free (void)
+{
+    identity_clear (&ident);
+}
@@ -0,0 +1,408 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* syscall */
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>  /* EXIT_FAILURE */
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "loop.h"
+
+
+#define LOOP_WATCHES  64      /* the server pool takes up to three per server */
+
+
+typedef enum {
+    WatchFree,
+    WatchFd,
+    WatchDrain,
+    WatchPid,
+    WatchSignal,
+    WatchTimer
+} WatchKind;
+
+typedef struct {
+    WatchKind kind;
+    int fd;           /* -1 for a pid without pidfd (SIGCHLD fallback) */
+    pid_t pid;
+    LoopDrain drain;  /* WatchDrain */
+} Watch;
+
+
+static Watch watches [LOOP_WATCHES];
+static int epfd = -1;
+static int sigfd = -1;
+static int timerfd = -1;
+static sigset_t oldmask;
+
+/* Supervised signals are blocked and read from the signalfd; SIGUSR1 is
+ * the server readiness handshake and SIGCHLD covers kernels without pidfd */
+static const int loop_signals [] = {
+    SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGPIPE, SIGUSR1, SIGCHLD
+};
+
+
+/*
+ * Code
+ */
+
+static Watch *
+watch_add (WatchKind kind, int fd, pid_t pid)
+{
+    struct epoll_event ev;
+    Watch *w;
+
+    for ( w = watches; w != watches + LOOP_WATCHES; w++ ) {
+        if ( w->kind == WatchFree )
+            break;
+    }
+    if ( w == watches + LOOP_WATCHES ) {
+        errorx ("too many watched descriptors");
+        return NULL;
+    }
+
+    if ( fd != -1 ) {
+        memset (&ev, 0, sizeof (ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = w;
+
+        if ( epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+            error ("could not watch descriptor %d", fd);
+            return NULL;
+        }
+    }
+
+    w->kind = kind;
+    w->fd = fd;
+    w->pid = pid;
+    w->drain = NULL;
+    return w;
+}
+
+static void
+watch_remove (Watch *w)
+{
+    if ( w->fd != -1 )
+        epoll_ctl (epfd, EPOLL_CTL_DEL, w->fd, NULL);
+
+    if ( w->kind == WatchPid && w->fd != -1 )
+        close (w->fd);
+
+    w->kind = WatchFree;
+    w->fd = -1;
+}
+
+static Watch *
+watch_find_pid (pid_t pid)
+{
+    Watch *w;
+
+    for ( w = watches; w != watches + LOOP_WATCHES; w++ ) {
+        if ( w->kind == WatchPid && w->pid == pid )
+            return w;
+    }
+    return NULL;
+}
+
+int
+loop_init (void)
+{
+    sigset_t mask;
+    int idx;
+
+    sigemptyset (&mask);
+    for ( idx = 0; idx < (int) countof (loop_signals); idx++ )
+        sigaddset (&mask, loop_signals [idx]);
+
+    sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+    epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if ( epfd == -1 ) {
+        error ("could not create epoll instance");
+        return False;
+    }
+
+    sigfd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if ( sigfd == -1 ) {
+        error ("could not create signalfd");
+        return False;
+    }
+
+    timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( timerfd == -1 ) {
+        error ("could not create timerfd");
+        return False;
+    }
+
+    return watch_add (WatchSignal, sigfd, 0) != NULL &&
+           watch_add (WatchTimer, timerfd, 0) != NULL;
+}
+
+void
+loop_child (void)
+{
+    /* Children must not inherit the blocked signals */
+    sigprocmask (SIG_SETMASK, &oldmask, NULL);
+}
+
+int
+loop_watch_fd (int fd)
+{
+    return watch_add (WatchFd, fd, 0) != NULL;
+}
+
+void
+loop_unwatch_fd (int fd)
+{
+    Watch *w;
+
+    for ( w = watches; w != watches + LOOP_WATCHES; w++ ) {
+        if ( (w->kind == WatchFd || w->kind == WatchDrain) && w->fd == fd ) {
+            watch_remove (w);
+            return;
+        }
+    }
+}
+
+/*
+ * Like loop_watch_fd (), but 'fd' is taken care of by 'drain' whichever
+ * loop_wait () runs at the time: callers waiting for something else need
+ * not know about it. loop_unwatch_fd () ends it.
+ */
+int
+loop_drain_fd (int fd, LoopDrain drain)
+{
+    Watch *w;
+
+    w = watch_add (WatchDrain, fd, 0);
+    if ( w == NULL )
+        return False;
+
+    w->drain = drain;
+    return True;
+}
+
+static int
+pidfd_open (pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall (SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+ * Watch 'pid' through 'fd', a pidfd we take over; with -1 one is opened
+ * here, and without pidfd support at all SIGCHLD tells us.
+ */
+int
+loop_watch_pidfd (pid_t pid, int fd)
+{
+    if ( fd == -1 )
+        fd = pidfd_open (pid);
+
+    if ( fd == -1 )
+        debug ("pidfd_open failed for pid %d, falling back to SIGCHLD", pid);
+    else
+        debugx ("watching pid %d through pidfd %d", pid, fd);
+
+    if ( watch_add (WatchPid, fd, pid) != NULL )
+        return True;
+
+    if ( fd != -1 )
+        close (fd);
+
+    return False;
+}
+
+int
+loop_watch_pid (pid_t pid)
+{
+    return loop_watch_pidfd (pid, -1);
+}
+
+int
+loop_has_pid (pid_t pid)
+{
+    return watch_find_pid (pid) != NULL;
+}
+
+static int
+reap (Watch *w, LoopEvent *ev)
+{
+    pid_t pid = w->pid, result;
+
+    do
+        result = wait4 (pid, &ev->status, WNOHANG, &ev->rusage);
+    while ( result == -1 && errno == EINTR );
+
+    if ( result == 0 )
+        return False;
+
+    /* Reaped by somebody else: the pidfd stays readable and would come
+     * back forever, so the child is gone for us too */
+    if ( result == -1 ) {
+        debug ("could not reap pid %d", pid);
+        ev->status = W_EXITCODE (EXIT_FAILURE, 0);
+        memset (&ev->rusage, 0, sizeof (ev->rusage));
+    }
+
+    watch_remove (w);
+    ev->kind = LoopExit;
+    ev->pid = pid;
+    return True;
+}
+
+static int
+reap_fallback (LoopEvent *ev)
+{
+    Watch *w;
+
+    /* Children without a pidfd are only noticed through SIGCHLD */
+    for ( w = watches; w != watches + LOOP_WATCHES; w++ ) {
+        if ( w->kind == WatchPid && w->fd == -1 && reap (w, ev) )
+            return True;
+    }
+    return False;
+}
+
+static void
+arm_timer (long long deadline)
+{
+    struct itimerspec its;
+
+    /* An all zero value disarms the timer */
+    memset (&its, 0, sizeof (its));
+    if ( deadline >= 0 ) {
+        /* 0 would disarm, so never let an expired deadline hit it */
+        deadline = MAX (deadline, 1);
+        its.it_value.tv_sec = deadline / 1000;
+        its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+    }
+    timerfd_settime (timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Wait for the next event until 'deadline' (mono_ms () based, -1 waits
+ * forever). Events that are not returned stay pending for the next call.
+ */
+LoopKind
+loop_wait (long long deadline, LoopEvent *ev)
+{
+    struct epoll_event eev;
+    struct signalfd_siginfo si;
+    uint64_t expirations;
+    Watch *w;
+    int count;
+
+    memset (ev, 0, sizeof (*ev));
+    ev->fd = -1;
+
+    /* A child could have gone away before its SIGCHLD was blocked */
+    if ( reap_fallback (ev) )
+        return LoopExit;
+
+    arm_timer (deadline);
+
+    for ( ;; ) {
+        count = epoll_wait (epfd, &eev, 1, -1);
+        if ( count == -1 ) {
+            if ( errno == EINTR )
+                continue;
+
+            error ("epoll_wait failed");
+            ev->kind = LoopError;
+            return LoopError;
+        }
+        w = eev.data.ptr;
+
+        switch (w->kind) {
+        case WatchTimer:
+            if ( read (timerfd, &expirations, sizeof (expirations)) == -1 && errno == EAGAIN )
+                continue;  /* re-armed meanwhile */
+
+            ev->kind = LoopTimeout;
+            return LoopTimeout;
+
+        case WatchSignal:
+            if ( read (sigfd, &si, sizeof (si)) != sizeof (si) )
+                continue;
+
+            if ( si.ssi_signo == SIGCHLD ) {
+                if ( reap_fallback (ev) )
+                    return LoopExit;
+                continue;
+            }
+            ev->kind = LoopSignal;
+            ev->signo = si.ssi_signo;
+            return LoopSignal;
+
+        case WatchPid:
+            if ( reap (w, ev) )
+                return LoopExit;
+            continue;
+
+        case WatchDrain:
+            w->drain (w->fd);
+            continue;
+
+        case WatchFd:
+            ev->kind = LoopFd;
+            ev->fd = w->fd;
+            return LoopFd;
+
+        default:
+            continue;
+        }
+    }
+}
+
+void
+loop_close (void)
+{
+    Watch *w;
+
+    for ( w = watches; w != watches + LOOP_WATCHES; w++ ) {
+        if ( w->kind != WatchFree )
+            watch_remove (w);
+    }
+    if ( timerfd != -1 )
+        close (timerfd);
+    if ( sigfd != -1 )
+        close (sigfd);
+    if ( epfd != -1 )
+        close (epfd);
+
+    epfd = sigfd = timerfd = -1;
+    sigprocmask (SIG_SETMASK, &oldmask, NULL);
+}
@@ -0,0 +1,59 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _LOOP_H
+#define _LOOP_H
+
+#include <sys/types.h>  /* pid_t */
+#include <sys/resource.h>  /* struct rusage */
+
+
+typedef enum {
+    LoopError = -1,
+    LoopTimeout,      /* the deadline passed */
+    LoopExit,         /* a watched child exited and has been reaped */
+    LoopSignal,       /* one of the supervised signals arrived */
+    LoopFd            /* a watched descriptor is readable */
+} LoopKind;
+
+typedef struct {
+    LoopKind kind;
+    int fd;           /* LoopFd */
+    pid_t pid;        /* LoopExit */
+    int status;       /* LoopExit: as returned by wait4 (), a failure when
+                       * the child could not be reaped */
+    struct rusage rusage;  /* LoopExit: what the child used */
+    int signo;        /* LoopSignal */
+} LoopEvent;
+
+/* Called from loop_wait () whenever 'fd' is readable, never returned */
+typedef void (*LoopDrain) (int fd);
+
+
+int loop_init (void);
+void loop_child (void);
+int loop_watch_fd (int fd);
+void loop_unwatch_fd (int fd);
+int loop_drain_fd (int fd, LoopDrain drain);
+int loop_watch_pid (pid_t pid);
+int loop_watch_pidfd (pid_t pid, int fd);
+int loop_has_pid (pid_t pid);
+LoopKind loop_wait (long long deadline, LoopEvent *ev);
+void loop_close (void);
+
+
+#endif  /* _LOOP_H */
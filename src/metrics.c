@@ -0,0 +1,343 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* accept4 */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#include "util.h"
+#include "loop.h"
+#include "restart.h"
+#include "watchdog.h"
+#include "metrics.h"
+
+
+#define METRICS_SOCKET  "xinit-metrics"
+#define METRICS_DIR     "/run/xinit"
+#define METRICS_PHASES  32
+#define METRICS_PAGE    8192
+
+
+typedef struct {
+    const char *name;     /* the trace_span () literal */
+    long long us;         /* its last duration */
+} Phase;
+
+
+/*
+ * Metrics in the Prometheus text format, on with 'metrics': every
+ * connection to the socket gets the current page and is closed, e.g.
+ * "socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/xinit-metrics-0". The socket is
+ * a drained descriptor of the event loop, an answer is a single
+ * non-blocking send (): nothing of it waits on the reader.
+ */
+static Phase phases [METRICS_PHASES];
+static int nphases = 0;
+static const char *ready_how = NULL;
+static long long ready_ms = -1;
+static pid_t server_pid = -1;
+static pid_t client_pid = -1;
+static long long session_start = 0;   /* ms */
+
+static struct sockaddr_un listenaddr;
+static int listenfd = -1;
+
+static char page [METRICS_PAGE];
+static int page_len;
+
+
+/*
+ * Code
+ */
+
+/* From trace_span (), whether tracing is on or not */
+void
+metrics_phase (const char *name, long long us)
+{
+    int idx;
+
+    if ( u_metrics == NULL )
+        return;
+
+    for ( idx = 0; idx < nphases && phases [idx].name != name; idx++ )
+        ;  /* NOP */
+
+    if ( idx == nphases ) {
+        if ( nphases == METRICS_PHASES )
+            return;
+        phases [nphases++].name = name;
+    }
+    phases [idx].us = us;
+}
+
+void
+metrics_ready (const char *how, long long ms)
+{
+    ready_how = how;
+    ready_ms = ms;
+}
+
+static void
+put (const char *fmt, ...)
+{
+    va_list args;
+    int len;
+
+    va_start (args, fmt);
+    len = vsnprintf (page + page_len, sizeof (page) - page_len, fmt, args);
+    va_end (args);
+
+    if ( len > 0 )
+        page_len = MIN (page_len + len, (int) sizeof (page) - 1);
+}
+
+/* One family after the other, for xinit itself and its reaped children */
+static void
+put_rusage (void)
+{
+    static const char * const who [] = { "xinit", "children" };
+    struct rusage ru [2];
+    int idx;
+
+    if ( getrusage (RUSAGE_SELF, ru) == -1 || getrusage (RUSAGE_CHILDREN, ru + 1) == -1 )
+        return;
+
+    put ("# HELP xinit_cpu_seconds_total CPU time; children only count once reaped.\n"
+         "# TYPE xinit_cpu_seconds_total counter\n");
+    for ( idx = 0; idx < 2; idx++ ) {
+        put ("xinit_cpu_seconds_total{process=\"%s\",mode=\"user\"} %ld.%06ld\n",
+            who [idx], (long) ru [idx].ru_utime.tv_sec, (long) ru [idx].ru_utime.tv_usec);
+        put ("xinit_cpu_seconds_total{process=\"%s\",mode=\"system\"} %ld.%06ld\n",
+            who [idx], (long) ru [idx].ru_stime.tv_sec, (long) ru [idx].ru_stime.tv_usec);
+    }
+
+    put ("# HELP xinit_max_rss_bytes Peak resident set size.\n"
+         "# TYPE xinit_max_rss_bytes gauge\n");
+    for ( idx = 0; idx < 2; idx++ )
+        put ("xinit_max_rss_bytes{process=\"%s\"} %ld\n", who [idx], ru [idx].ru_maxrss * 1024);
+
+    put ("# HELP xinit_page_faults_total Page faults.\n"
+         "# TYPE xinit_page_faults_total counter\n");
+    for ( idx = 0; idx < 2; idx++ ) {
+        put ("xinit_page_faults_total{process=\"%s\",kind=\"major\"} %ld\n", who [idx], ru [idx].ru_majflt);
+        put ("xinit_page_faults_total{process=\"%s\",kind=\"minor\"} %ld\n", who [idx], ru [idx].ru_minflt);
+    }
+}
+
+/* From the watchdog's histogram, once it has any */
+static void
+put_roundtrip (void)
+{
+    static const double quantiles [] = { 0.5, 0.9, 0.99 };
+    unsigned long count;
+    long long us, sum;
+    int idx;
+
+    count = watchdog_count (&sum);
+    if ( count == 0 )
+        return;
+
+    put ("# HELP xinit_x_roundtrip_seconds X server round-trip latency.\n"
+         "# TYPE xinit_x_roundtrip_seconds summary\n");
+    for ( idx = 0; idx < (int) countof (quantiles); idx++ ) {
+        us = watchdog_quantile (quantiles [idx]);
+        put ("xinit_x_roundtrip_seconds{quantile=\"%g\"} %lld.%06lld\n", quantiles [idx], us / 1000000, us % 1000000);
+    }
+    put ("xinit_x_roundtrip_seconds_sum %lld.%06lld\n", sum / 1000000, sum % 1000000);
+    put ("xinit_x_roundtrip_seconds_count %lu\n", count);
+}
+
+static void
+format_page (void)
+{
+    long long now = mono_ms (), last;
+    int idx, server, client;
+
+    page_len = 0;
+
+    put ("# HELP xinit_phase_seconds Duration of the last run of each startup phase.\n"
+         "# TYPE xinit_phase_seconds gauge\n");
+    for ( idx = 0; idx < nphases; idx++ )
+        put ("xinit_phase_seconds{phase=\"%s\"} %lld.%06lld\n", phases [idx].name,
+            phases [idx].us / 1000000, phases [idx].us % 1000000);
+
+    if ( ready_ms >= 0 )
+        put ("# HELP xinit_server_ready_seconds Server fork until it took connections.\n"
+             "# TYPE xinit_server_ready_seconds gauge\n"
+             "xinit_server_ready_seconds{how=\"%s\"} %lld.%03lld\n", ready_how, ready_ms / 1000, ready_ms % 1000);
+
+    put_roundtrip ();
+
+    restart_counts (&server, &client, &last);
+    put ("# HELP xinit_restarts_total Restarts after a crash.\n"
+         "# TYPE xinit_restarts_total counter\n"
+         "xinit_restarts_total{process=\"server\"} %d\n"
+         "xinit_restarts_total{process=\"client\"} %d\n", server, client);
+
+    put ("# HELP xinit_pid Current process ids, 0 for none.\n"
+         "# TYPE xinit_pid gauge\n"
+         "xinit_pid{process=\"xinit\"} %d\n"
+         "xinit_pid{process=\"server\"} %d\n"
+         "xinit_pid{process=\"client\"} %d\n",
+         (int) getpid (), (int) MAX (server_pid, 0), (int) MAX (client_pid, 0));
+
+    if ( last == 0 )
+        last = session_start;
+    put ("# HELP xinit_session_seconds Time since the client was first started.\n"
+         "# TYPE xinit_session_seconds gauge\n"
+         "xinit_session_seconds %lld.%03lld\n"
+         "# HELP xinit_since_restart_seconds Time since the last restart, or the start.\n"
+         "# TYPE xinit_since_restart_seconds gauge\n"
+         "xinit_since_restart_seconds %lld.%03lld\n",
+         (now - session_start) / 1000, (now - session_start) % 1000, (now - last) / 1000, (now - last) % 1000);
+
+    put_rusage ();
+}
+
+static void
+serve (int fd)
+{
+    int conn;
+
+    for ( ;; ) {
+        conn = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if ( conn == -1 ) {
+            if ( errno != EAGAIN && errno != EINTR )
+                debug ("metrics: accept failed");
+            if ( errno != EINTR )
+                return;
+            continue;
+        }
+
+        format_page ();
+        if ( send (conn, page, page_len, MSG_NOSIGNAL | MSG_DONTWAIT) != page_len )
+            debug ("metrics: short answer");
+        close (conn);
+    }
+}
+
+/* $XDG_RUNTIME_DIR/xinit-metrics-<display>, or /run/xinit/... for root */
+static int
+metrics_address (struct sockaddr_un *addr)
+{
+    const char *dir, *display;
+    char number [16];
+    int len;
+
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+
+    /* ":1.0" is display 1 */
+    display = u_display != NULL && strrchr (u_display, ':') != NULL ? strrchr (u_display, ':') + 1 : "0";
+    snprintf (number, sizeof (number), "%.*s", (int) strcspn (display, "."), display);
+
+    dir = getenv ("XDG_RUNTIME_DIR");
+    if ( strcmp (u_metrics, "auto") != 0 )
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s", u_metrics);
+    else if ( dir != NULL && *dir == '/' )
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s/%s-%s", dir, METRICS_SOCKET, number);
+    else {
+        if ( mkdir (METRICS_DIR, 0755) == -1 && errno != EEXIST )
+            debug ("metrics: could not create %s", METRICS_DIR);
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s/%s-%s", METRICS_DIR, METRICS_SOCKET, number);
+    }
+
+    if ( len >= (int) sizeof (addr->sun_path) ) {
+        errorx ("metrics socket path too long");
+        return False;
+    }
+    return True;
+}
+
+static void
+metrics_listen (void)
+{
+    mode_t mask;
+    int fd, result;
+
+    if ( !metrics_address (&listenaddr) )
+        return;
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( fd == -1 ) {
+        error ("could not create metrics socket");
+        return;
+    }
+
+    /* Ours only: pids and timings are nobody else's business */
+    unlink (listenaddr.sun_path);
+    mask = umask (0077);
+    result = bind (fd, (struct sockaddr *) &listenaddr, sizeof (listenaddr));
+    umask (mask);
+
+    if ( result == -1 || listen (fd, 8) == -1 ) {
+        error ("could not listen on %s", listenaddr.sun_path);
+        close (fd);
+        return;
+    }
+
+    if ( !loop_drain_fd (fd, serve) ) {
+        close (fd);
+        unlink (listenaddr.sun_path);
+        return;
+    }
+    listenfd = fd;
+    debugx ("metrics on %s", listenaddr.sun_path);
+}
+
+/*
+ * Server and client run: the first time once the display is known,
+ * which names the socket, and again after every restart.
+ */
+void
+metrics_running (pid_t server, pid_t client)
+{
+    if ( u_metrics == NULL )
+        return;
+
+    server_pid = server;
+    client_pid = client;
+    if ( session_start != 0 )
+        return;
+
+    session_start = mono_ms ();
+    metrics_listen ();
+}
+
+void
+metrics_close (void)
+{
+    if ( listenfd == -1 )
+        return;
+
+    loop_unwatch_fd (listenfd);
+    close (listenfd);
+    unlink (listenaddr.sun_path);
+    listenfd = -1;
+}
@@ -0,0 +1,704 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* pipe2, accept4 */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "loop.h"
+#include "spawn.h"
+#include "pool.h"
+
+
+#define POOL_SOCKET    "xinit-pool"
+#define POOL_MAX       16      /* servers */
+#define POOL_WAITERS   8       /* lease requests queued while no server is ready */
+#define POOL_FAILURES  3       /* servers failing to start in a row before we give up */
+#define POOL_ARGS      104     /* xinit's 96 server arguments and ours */
+
+
+/*
+ * Server pool for headless test farms: "xinit -pool -- /usr/bin/Xvfb"
+ * keeps 'pool-size' servers started and ready, and every other xinit run
+ * with 'pool-size' set asks it for one before starting a server itself.
+ * A lease is a connection to the pool socket: the pool answers with the
+ * display, and the lease ends when the connection is closed, which is
+ * when that xinit exits. The server resets itself once its last client
+ * is gone, and is replaced by a fresh one after 'pool-recycle' leases.
+ */
+typedef enum {
+    SlotEmpty,
+    SlotStarting,     /* waiting for -displayfd */
+    SlotReady,
+    SlotLeased,
+    SlotStopping
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    pid_t pid;
+    int pipe [2];     /* -displayfd */
+    char num [16];    /* what the server wrote to it */
+    int numlen;
+    char display [16];
+    int conn;         /* the lease */
+    int leases;
+    int killed;       /* SIGKILL sent */
+    long long since;  /* mono_ms () of the last state change */
+} Slot;
+
+
+static Slot slots [POOL_MAX];
+static int waiters [POOL_WAITERS];
+static int nwaiters = 0;
+static int failures = 0;
+static int quitting = False;
+static char **server = NULL;
+static int listenfd = -1;
+static struct sockaddr_un listenaddr;
+static int leasefd = -1;    /* our lease, on the client side */
+
+
+/*
+ * Code
+ */
+
+static int
+pool_address (struct sockaddr_un *addr)
+{
+    const char *dir;
+    int len;
+
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+
+    dir = getenv ("XDG_RUNTIME_DIR");
+    if ( u_pool_socket != NULL )
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s", u_pool_socket);
+    else if ( dir != NULL && *dir == '/' )
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s/%s", dir, POOL_SOCKET);
+    else
+        len = snprintf (addr->sun_path, sizeof (addr->sun_path), "/tmp/%s-%d", POOL_SOCKET, (int) getuid ());
+
+    if ( len >= (int) sizeof (addr->sun_path) ) {
+        errorx ("pool socket path too long");
+        return False;
+    }
+    return True;
+}
+
+static int
+pool_connect (const struct sockaddr_un *addr)
+{
+    int fd;
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ( fd == -1 )
+        return -1;
+
+    if ( connect (fd, (const struct sockaddr *) addr, sizeof (*addr)) == -1 ) {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+pool_listen (void)
+{
+    mode_t mask;
+    int fd, result;
+
+    if ( !pool_address (&listenaddr) )
+        return False;
+
+    /* A socket nobody answers on is left over from a pool that died */
+    fd = pool_connect (&listenaddr);
+    if ( fd != -1 ) {
+        errorx ("a server pool already runs on %s", listenaddr.sun_path);
+        close (fd);
+        return False;
+    }
+    unlink (listenaddr.sun_path);
+
+    fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( fd == -1 ) {
+        error ("could not create pool socket");
+        return False;
+    }
+
+    /* Only our own user may lease */
+    mask = umask (0077);
+    result = bind (fd, (struct sockaddr *) &listenaddr, sizeof (listenaddr));
+    umask (mask);
+
+    if ( result == -1 || listen (fd, POOL_WAITERS) == -1 ) {
+        error ("could not listen on %s", listenaddr.sun_path);
+        close (fd);
+        return False;
+    }
+
+    if ( !loop_watch_fd (fd) ) {
+        close (fd);
+        unlink (listenaddr.sun_path);
+        return False;
+    }
+    listenfd = fd;
+    return True;
+}
+
+static void
+drop_fd (int *fd)
+{
+    if ( *fd != -1 ) {
+        loop_unwatch_fd (*fd);
+        close (*fd);
+        *fd = -1;
+    }
+}
+
+static void
+slot_clear (Slot *slot)
+{
+    drop_fd (&slot->pipe [0]);
+    drop_fd (&slot->conn);
+    slot->state = SlotEmpty;
+    slot->pid = -1;
+    slot->leases = 0;
+}
+
+static int
+slot_setup (void *data)
+{
+    Slot *slot = data;
+
+    /* Runs between clone3 () and exec: async-signal-safe calls only */
+    loop_child ();
+    setpgid (0, getpid ());
+
+    /* The write end has to survive exec */
+    fcntl (slot->pipe [1], F_SETFD, 0);
+    return True;
+}
+
+/* False only when the loop cannot take one more server */
+static int
+slot_start (Slot *slot)
+{
+    char *argv [POOL_ARGS], fdbuf [12];
+    Spawn sp;
+    int count, pidfd;
+
+    if ( pipe2 (slot->pipe, O_CLOEXEC) == -1 ) {
+        error ("could not create displayfd pipe");
+        failures++;
+        return True;
+    }
+
+    for ( count = 0; server [count] != NULL && count < POOL_ARGS - 6; count++ )
+        argv [count] = server [count];
+
+    snprintf (fdbuf, sizeof (fdbuf), "%d", slot->pipe [1]);
+    argv [count++] = (char *) "-displayfd";
+    argv [count++] = fdbuf;
+    if ( u_pool_screen != NULL ) {
+        argv [count++] = (char *) "-screen";
+        argv [count++] = (char *) "0";
+        argv [count++] = u_pool_screen;
+    }
+    argv [count] = NULL;
+
+    spawn_init (&sp, argv);
+    sp.setup = slot_setup;
+    sp.data = slot;
+    sp.safe = True;
+
+    slot->since = mono_ms ();
+    slot->pid = spawn (&sp, &pidfd);
+    spawn_close (&sp);
+
+    /* We only read, EOF then means the server is gone */
+    close (slot->pipe [1]);
+    slot->pipe [1] = -1;
+
+    if ( slot->pid == -1 ) {
+        error ("unable to run server \"%s\"", argv [0]);
+        close (slot->pipe [0]);
+        slot->pipe [0] = -1;
+        failures++;
+        return True;
+    }
+
+    slot->state = SlotStarting;
+    slot->numlen = 0;
+    slot->killed = False;
+
+    if ( !loop_watch_pidfd (slot->pid, pidfd) ) {
+        kill (slot->pid, SIGKILL);
+        slot_clear (slot);
+        return False;
+    }
+    if ( !loop_watch_fd (slot->pipe [0]) ) {
+        close (slot->pipe [0]);
+        slot->pipe [0] = -1;
+        return False;
+    }
+    debugx ("pool server started: pid=%d", slot->pid);
+    return True;
+}
+
+static void
+slot_stop (Slot *slot)
+{
+    drop_fd (&slot->pipe [0]);
+    drop_fd (&slot->conn);
+
+    slot->state = SlotStopping;
+    slot->since = mono_ms ();
+    if ( killpg (slot->pid, SIGTERM) == -1 && errno != ESRCH )
+        error ("can't kill X server %d", slot->pid);
+}
+
+static void
+slot_ready (Slot *slot)
+{
+    ssize_t count;
+
+    count = read (slot->pipe [0], slot->num + slot->numlen, sizeof (slot->num) - 1 - slot->numlen);
+    if ( count == -1 && (errno == EINTR || errno == EAGAIN) )
+        return;
+
+    /* EOF: the server exits, its LoopExit follows */
+    if ( count <= 0 ) {
+        drop_fd (&slot->pipe [0]);
+        return;
+    }
+
+    slot->numlen += count;
+    slot->num [slot->numlen] = '\0';
+    if ( strchr (slot->num, '\n') == NULL && slot->numlen < (int) sizeof (slot->num) - 1 )
+        return;
+
+    drop_fd (&slot->pipe [0]);
+    snprintf (slot->display, sizeof (slot->display), ":%d", atoi (slot->num));
+    slot->state = SlotReady;
+    failures = 0;
+    debugx ("pool server %d ready on %s after %lld ms", slot->pid, slot->display, mono_ms () - slot->since);
+}
+
+static Slot *
+find_slot (SlotState state)
+{
+    int idx;
+
+    for ( idx = 0; idx < u_pool_size; idx++ ) {
+        if ( slots [idx].state == state )
+            return slots + idx;
+    }
+    return NULL;
+}
+
+/* Hand out ready servers, first come first served */
+static void
+dispatch (void)
+{
+    char buf [20];
+    Slot *slot;
+    int conn, len;
+
+    while ( nwaiters != 0 && (slot = find_slot (SlotReady)) != NULL ) {
+        conn = waiters [0];
+        memmove (waiters, waiters + 1, --nwaiters * sizeof (int));
+
+        len = snprintf (buf, sizeof (buf), "%s\n", slot->display);
+        if ( send (conn, buf, len, MSG_NOSIGNAL) != len ) {
+            debug ("lease request went away");
+            drop_fd (&conn);
+            continue;
+        }
+
+        slot->conn = conn;
+        slot->state = SlotLeased;
+        slot->since = mono_ms ();
+        debugx ("%s leased", slot->display);
+    }
+}
+
+static void
+pool_accept (void)
+{
+    int fd;
+
+    fd = accept4 (listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if ( fd == -1 )
+        return;
+
+    /* Closing on a full queue sends the requester to its own server */
+    if ( nwaiters == POOL_WAITERS || !loop_watch_fd (fd) ) {
+        debugx ("lease queue full");
+        close (fd);
+        return;
+    }
+    waiters [nwaiters++] = fd;
+}
+
+/* True when the peer of 'fd' hung up; anything it sends is dropped */
+static int
+hung_up (int fd)
+{
+    char buf [64];
+    ssize_t count;
+
+    count = recv (fd, buf, sizeof (buf), 0);
+    return count == 0 || (count == -1 && errno != EINTR && errno != EAGAIN);
+}
+
+static void
+lease_end (Slot *slot)
+{
+    drop_fd (&slot->conn);
+    slot->leases++;
+    debugx ("%s returned after %lld ms, lease %d of %d", slot->display,
+        mono_ms () - slot->since, slot->leases, u_pool_recycle);
+
+    if ( slot->leases >= u_pool_recycle )
+        slot_stop (slot);
+    else
+        slot->state = SlotReady;
+}
+
+static void
+pool_fd (int fd)
+{
+    int idx;
+
+    if ( fd == listenfd ) {
+        pool_accept ();
+        return;
+    }
+
+    for ( idx = 0; idx < u_pool_size; idx++ ) {
+        if ( slots [idx].pipe [0] == fd ) {
+            slot_ready (slots + idx);
+            return;
+        }
+        if ( slots [idx].conn == fd ) {
+            if ( hung_up (fd) )
+                lease_end (slots + idx);
+            return;
+        }
+    }
+
+    for ( idx = 0; idx < nwaiters; idx++ ) {
+        if ( waiters [idx] == fd ) {
+            if ( hung_up (fd) ) {
+                drop_fd (&waiters [idx]);
+                memmove (waiters + idx, waiters + idx + 1, (--nwaiters - idx) * sizeof (int));
+            }
+            return;
+        }
+    }
+}
+
+static void
+pool_exit (const LoopEvent *ev)
+{
+    int idx;
+
+    for ( idx = 0; idx < u_pool_size; idx++ ) {
+        if ( slots [idx].pid == ev->pid )
+            break;
+    }
+    if ( idx == u_pool_size )
+        return;
+
+    switch (slots [idx].state) {
+    case SlotStarting:
+        errorx ("pool server %d exited before it was ready: status %d", ev->pid, ev->status);
+        failures++;
+        break;
+
+    case SlotStopping:
+        debugx ("pool server %d stopped", ev->pid);
+        break;
+
+    default:
+        errorx ("pool server %d on %s exited: status %d", ev->pid, slots [idx].display, ev->status);
+        break;
+    }
+    slot_clear (slots + idx);
+}
+
+/* The next server start or stop that runs out of time */
+static long long
+pool_deadline (void)
+{
+    long long deadline = -1, when;
+    Slot *slot;
+
+    for ( slot = slots; slot != slots + u_pool_size; slot++ ) {
+        if ( slot->state == SlotStarting )
+            when = slot->since + u_server_timeout;
+        else if ( slot->state == SlotStopping && !slot->killed )
+            when = slot->since + u_term_grace;
+        else
+            continue;
+
+        if ( deadline == -1 || when < deadline )
+            deadline = when;
+    }
+    return deadline;
+}
+
+static void
+pool_expire (void)
+{
+    long long now = mono_ms ();
+    Slot *slot;
+
+    for ( slot = slots; slot != slots + u_pool_size; slot++ ) {
+        if ( slot->state == SlotStarting && now >= slot->since + u_server_timeout ) {
+            errorx ("pool server %d not ready after %d ms", slot->pid, u_server_timeout);
+            failures++;
+            slot_stop (slot);
+        } else if ( slot->state == SlotStopping && !slot->killed && now >= slot->since + u_term_grace ) {
+            errorx ("X server %d slow to shut down, sending KILL signal", slot->pid);
+            killpg (slot->pid, SIGKILL);
+            slot->killed = True;
+        }
+    }
+}
+
+static void
+pool_quit (void)
+{
+    Slot *slot;
+
+    if ( quitting )
+        return;
+
+    quitting = True;
+    drop_fd (&listenfd);
+    unlink (listenaddr.sun_path);
+
+    while ( nwaiters != 0 )
+        drop_fd (&waiters [--nwaiters]);
+
+    for ( slot = slots; slot != slots + u_pool_size; slot++ ) {
+        if ( slot->pid > 0 && slot->state != SlotStopping )
+            slot_stop (slot);
+    }
+}
+
+static int
+pool_running (void)
+{
+    Slot *slot;
+
+    for ( slot = slots; slot != slots + u_pool_size; slot++ ) {
+        if ( slot->pid > 0 )
+            return True;
+    }
+    return False;
+}
+
+/* Start servers for empty slots; False once they keep failing */
+static int
+pool_fill (void)
+{
+    Slot *slot;
+
+    for ( slot = slots; slot != slots + u_pool_size; slot++ ) {
+        if ( slot->state != SlotEmpty )
+            continue;
+
+        if ( failures >= POOL_FAILURES ) {
+            errorx ("pool servers keep failing, giving up");
+            return False;
+        }
+        if ( !slot_start (slot) )
+            return False;
+    }
+    return True;
+}
+
+/*
+ * The pool itself, until a termination signal: 'server_argv' is the
+ * server command line, "-displayfd" and "-screen" are added here.
+ */
+int
+pool_run (char **server_argv)
+{
+    LoopEvent ev;
+    int idx, result = True;
+
+    if ( u_pool_size < 1 || u_pool_size > POOL_MAX ) {
+        errorx ("'pool-size' must be between 1 and %d", POOL_MAX);
+        return False;
+    }
+
+    server = server_argv;
+    for ( idx = 0; idx < POOL_MAX; idx++ ) {
+        slots [idx].pipe [0] = slots [idx].pipe [1] = -1;
+        slots [idx].conn = -1;
+        slot_clear (slots + idx);
+    }
+
+    if ( !loop_init () || !pool_listen () ) {
+        loop_close ();
+        return False;
+    }
+    debugx ("server pool of %d on %s", u_pool_size, listenaddr.sun_path);
+
+    while ( !quitting || pool_running () ) {
+        if ( !quitting && !pool_fill () ) {
+            result = False;
+            pool_quit ();
+        }
+
+        switch (loop_wait (pool_deadline (), &ev)) {
+        case LoopFd:
+            pool_fd (ev.fd);
+            break;
+
+        case LoopExit:
+            pool_exit (&ev);
+            break;
+
+        case LoopTimeout:
+            pool_expire ();
+            break;
+
+        case LoopSignal:
+            if ( ev.signo != SIGUSR1 && ev.signo != SIGPIPE ) {
+                debugx ("signal %d, stopping the pool", ev.signo);
+                pool_quit ();
+            }
+            break;
+
+        case LoopError:
+            pool_quit ();
+            for ( idx = 0; idx < u_pool_size; idx++ ) {
+                if ( slots [idx].pid > 0 )
+                    killpg (slots [idx].pid, SIGKILL);
+            }
+            loop_close ();
+            return False;
+        }
+
+        if ( !quitting )
+            dispatch ();
+    }
+
+    loop_close ();
+    return result;
+}
+
+/*
+ * Ask the pool for a display. False when there is no pool or it did not
+ * answer within 'server-timeout': we then start a server of our own.
+ */
+int
+pool_lease (void)
+{
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+    long long deadline, now;
+    char buf [16], *end = NULL;
+    ssize_t count;
+    int fd, result, len = 0;
+
+    if ( !pool_address (&addr) )
+        return False;
+
+    fd = pool_connect (&addr);
+    if ( fd == -1 ) {
+        debugx ("no server pool on %s", addr.sun_path);
+        return False;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    deadline = mono_ms () + u_server_timeout;
+
+    while ( end == NULL && len < (int) sizeof (buf) - 1 ) {
+        now = mono_ms ();
+        if ( now >= deadline )
+            goto fail;
+
+        result = poll (&pfd, 1, (int) (deadline - now));
+        if ( result == -1 && errno == EINTR )
+            continue;
+        if ( result <= 0 )
+            goto fail;
+
+        count = read (fd, buf + len, sizeof (buf) - 1 - len);
+        if ( count == -1 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+            goto fail;
+
+        len += count;
+        buf [len] = '\0';
+        end = strchr (buf, '\n');
+    }
+
+    if ( end == NULL || buf [0] != ':' )
+        goto fail;
+
+    *end = '\0';
+    if ( !set_display (buf) ) {
+        error_no_memory ();
+        close (fd);
+        return False;
+    }
+
+    /* Held until we exit, see pool_return () */
+    leasefd = fd;
+    debugx ("leased display %s from the pool", u_display);
+    return True;
+
+fail:
+
+    errorx ("the server pool on %s did not lease a display", addr.sun_path);
+    close (fd);
+    return False;
+}
+
+/* Give the leased server back */
+void
+pool_return (void)
+{
+    if ( leasefd != -1 ) {
+        close (leasefd);
+        leasefd = -1;
+    }
+}
@@ -0,0 +1,550 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>  /* PATH_MAX */
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "ident.h"
+#include "prefetch.h"
+
+
+#define PREFETCH_FILE    "xinit-prefetch"
+#define PREFETCH_FILES   256     /* working set entries kept */
+#define PREFETCH_MAX     65536   /* bytes of profile read */
+#define PREFETCH_SLOTS   512     /* hash slots, twice the entries */
+#define SAMPLE_INTERVAL  500     /* ms between /proc samples */
+#define SAMPLE_WINDOW    10000   /* ms of session that get sampled */
+#define MAX_DEPTH        32      /* ancestors followed per process */
+#define SAMPLE_PROCS     1024    /* session processes sampled at a time */
+
+
+/*
+ * The working set of a session is every file mapped by the server, the
+ * client and their descendants: binaries, shared libraries, server
+ * modules. It is learned by sampling /proc/<pid>/maps during the first
+ * seconds of a session and kept in the user's cache directory, one path
+ * per line in first-seen order. The next start reads it ahead in a
+ * thread while the server initialises.
+ *
+ * A server running as root is only ours to look at until the client
+ * drops our privileges, so it gets a sample of its own once it is ready,
+ * with its modules loaded. The session is found by following the
+ * children lists down from the server and the client; kernels without
+ * them get a scan of all of /proc.
+ */
+typedef struct {
+    char *files [PREFETCH_FILES];
+    int count;
+    int slots [PREFETCH_SLOTS];     /* index + 1 into files, 0 if free */
+} WorkingSet;
+
+typedef struct {
+    pid_t pid;
+    pid_t ppid;
+} Proc;
+
+
+static WorkingSet seen;
+static volatile int replayed = -1;  /* files read ahead, -1 while running */
+static volatile long long replay_time;
+static pid_t roots [2] = { -1, -1 };
+static long long window_end = -1;
+static long long next_sample = -1;
+static int server_blind = False;    /* its tree could not be sampled */
+static int walk = -1;               /* children lists, -1 until known */
+
+
+/*
+ * Code
+ */
+
+static unsigned
+hash_path (const char *path)
+{
+    unsigned hash = 2166136261u;
+
+    while ( *path != '\0' ) {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void
+set_add (WorkingSet *set, const char *path)
+{
+    unsigned slot;
+
+    if ( set->count == PREFETCH_FILES )
+        return;
+
+    for ( slot = hash_path (path) % PREFETCH_SLOTS;
+          set->slots [slot] != 0;
+          slot = (slot + 1) % PREFETCH_SLOTS ) {
+        if ( strcmp (set->files [set->slots [slot] - 1], path) == 0 )
+            return;
+    }
+
+    set->files [set->count] = strdup (path);
+    if ( set->files [set->count] == NULL )
+        return;
+
+    set->slots [slot] = ++set->count;
+}
+
+static void
+set_clear (WorkingSet *set)
+{
+    int idx;
+
+    for ( idx = 0; idx < set->count; idx++ )
+        free (set->files [idx]);
+
+    memset (set, 0, sizeof (*set));
+}
+
+/*
+ * Replay
+ */
+
+static void *
+prefetch_run (void *data)
+{
+    char *profile = data, *path, *next;
+    struct stat st;
+    long long start;
+    int fd, count = 0;
+
+    start = mono_us ();
+    for ( path = profile; *path != '\0'; path = next ) {
+        next = strchr (path, '\n');
+        if ( next == NULL )
+            break;
+        *next++ = '\0';
+
+        fd = open (path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+        if ( fd == -1 )
+            continue;
+
+        /* We may still be root: only what anybody could read anyway */
+        if ( fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && (st.st_mode & S_IROTH) ) {
+            posix_fadvise (fd, 0, 0, POSIX_FADV_WILLNEED);
+            count++;
+        }
+        close (fd);
+    }
+    /* No stdio here: a fork while we hold the stderr lock would leave
+     * the child stuck on it; prefetch_record () reports for us */
+    replay_time = mono_us () - start;
+    replayed = count;
+
+    free (profile);
+    return NULL;
+}
+
+static int
+profile_path (char *buf, int len)
+{
+    const char *dir, *home;
+
+    /* $XDG_CACHE_HOME, ~/.cache without it */
+    dir = getenv ("XDG_CACHE_HOME");
+    if ( dir != NULL && *dir == '/' )
+        return snprintf (buf, len, "%s/%s", dir, PREFETCH_FILE) < len;
+
+    home = ident_home ();
+    if ( home == NULL )
+        return False;
+
+    return snprintf (buf, len, "%s/.cache/%s", home, PREFETCH_FILE) < len;
+}
+
+static char *
+load_profile (uid_t uid)
+{
+    char path [PATH_MAX], *data;
+    struct stat st;
+    ssize_t count;
+    int fd;
+
+    if ( !profile_path (path, sizeof (path)) )
+        return NULL;
+
+    fd = open (path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if ( fd == -1 )
+        return NULL;
+
+    /* We may still be root here; only the user's own file will do */
+    if ( fstat (fd, &st) == -1 || !S_ISREG (st.st_mode) || st.st_uid != uid ||
+         (st.st_mode & (S_IWGRP | S_IWOTH)) != 0 ) {
+        debugx ("prefetch: %s is not trusted", path);
+        close (fd);
+        return NULL;
+    }
+
+    data = x_malloc (PREFETCH_MAX + 1);
+    if ( data == NULL ) {
+        close (fd);
+        return NULL;
+    }
+
+    count = read (fd, data, PREFETCH_MAX);
+    close (fd);
+
+    if ( count <= 0 ) {
+        free (data);
+        return NULL;
+    }
+    data [count] = '\0';
+    return data;
+}
+
+void
+prefetch_start (uid_t uid)
+{
+    pthread_t thread;
+    char *profile;
+
+    if ( !u_prefetch )
+        return;
+
+    profile = load_profile (uid);
+    if ( profile == NULL ) {
+        debugx ("prefetch: no working set for user %d yet", (int) uid);
+        return;
+    }
+
+    /* Nobody waits for it; page cache hits are the only result */
+    if ( pthread_create (&thread, NULL, prefetch_run, profile) != 0 ) {
+        debug ("prefetch: could not start thread");
+        free (profile);
+        return;
+    }
+    pthread_detach (thread);
+}
+
+/*
+ * Recording
+ */
+
+static int
+read_procs (Proc **procs)
+{
+    char path [64], buf [512], *p;
+    struct dirent *ent;
+    Proc *list = NULL, *temp;
+    int fd, pid, count = 0, size = 0;
+    ssize_t len;
+    DIR *dir;
+
+    dir = opendir ("/proc");
+    if ( dir == NULL )
+        return 0;
+
+    while ( (ent = readdir (dir)) != NULL ) {
+        if ( !isdigit ((unsigned char) ent->d_name [0]) )
+            continue;
+
+        pid = atoi (ent->d_name);
+        snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if ( fd == -1 )
+            continue;
+
+        len = read (fd, buf, sizeof (buf) - 1);
+        close (fd);
+        if ( len <= 0 )
+            continue;
+        buf [len] = '\0';
+
+        /* "pid (comm) state ppid ...", comm may hold anything */
+        p = strrchr (buf, ')');
+        if ( p == NULL )
+            continue;
+
+        if ( count == size ) {
+            size += 256;
+            temp = realloc (list, size * sizeof (Proc));
+            if ( temp == NULL )
+                break;
+            list = temp;
+        }
+        list [count].pid = pid;
+        list [count].ppid = strtol (p + 4, NULL, 10);
+        count++;
+    }
+    closedir (dir);
+
+    *procs = list;
+    return count;
+}
+
+static int
+in_session (const Proc *procs, int count, pid_t pid)
+{
+    int depth, idx;
+
+    for ( depth = 0; depth < MAX_DEPTH && pid > 1; depth++ ) {
+        if ( pid == roots [0] || pid == roots [1] )
+            return True;
+
+        for ( idx = 0; idx < count && procs [idx].pid != pid; idx++ )
+            ;  /* NOP */
+
+        if ( idx == count )
+            return False;
+
+        pid = procs [idx].ppid;
+    }
+    return False;
+}
+
+/* False when the process is not ours to look at */
+static int
+sample_maps (pid_t pid)
+{
+    char path [64], line [PATH_MAX + 128], *file, *end;
+    FILE *maps;
+
+    snprintf (path, sizeof (path), "/proc/%d/maps", (int) pid);
+    maps = fopen (path, "re");
+    if ( maps == NULL )
+        return errno != EACCES && errno != EPERM;  /* or just gone */
+
+    while ( fgets (line, sizeof (line), maps) != NULL ) {
+        /* address perms offset dev inode path */
+        file = strchr (line, '/');
+        if ( file == NULL )
+            continue;
+
+        end = strchr (file, '\n');
+        if ( end != NULL )
+            *end = '\0';
+
+        if ( strstr (file, " (deleted)") == NULL )
+            set_add (&seen, file);
+    }
+    fclose (maps);
+    return True;
+}
+
+/* Appends the children of all threads of 'pid' to 'list' */
+static int
+add_children (pid_t pid, pid_t *list, int count)
+{
+    char path [64], buf [4096], *p, *end;
+    struct dirent *ent;
+    ssize_t len;
+    DIR *dir;
+    int fd;
+
+    snprintf (path, sizeof (path), "/proc/%d/task", (int) pid);
+    dir = opendir (path);
+    if ( dir == NULL )
+        return count;
+
+    while ( (ent = readdir (dir)) != NULL && count < SAMPLE_PROCS ) {
+        if ( !isdigit ((unsigned char) ent->d_name [0]) )
+            continue;
+
+        snprintf (path, sizeof (path), "/proc/%d/task/%d/children", (int) pid, atoi (ent->d_name));
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if ( fd == -1 )
+            continue;
+
+        len = read (fd, buf, sizeof (buf) - 1);
+        close (fd);
+        if ( len <= 0 )
+            continue;
+        buf [len] = '\0';
+
+        for ( p = buf; count < SAMPLE_PROCS; p = end ) {
+            list [count] = strtol (p, &end, 10);
+            if ( end == p )
+                break;
+            count++;
+        }
+    }
+    closedir (dir);
+    return count;
+}
+
+/* The session's processes, breadth first from the two roots */
+static void
+sample_tree (void)
+{
+    pid_t list [SAMPLE_PROCS];
+    int head, idx, count = 0;
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( roots [idx] > 0 )
+            list [count++] = roots [idx];
+    }
+
+    for ( head = 0; head < count; head++ ) {
+        if ( !sample_maps (list [head]) && head == 0 && roots [0] > 0 && !server_blind ) {
+            debugx ("prefetch: server %d is not ours to sample any more", (int) roots [0]);
+            server_blind = True;
+        }
+        count = add_children (list [head], list, count);
+    }
+}
+
+static void
+sample_all (void)
+{
+    Proc *procs = NULL;
+    int idx, count;
+
+    count = read_procs (&procs);
+    for ( idx = 0; idx < count; idx++ ) {
+        if ( in_session (procs, count, procs [idx].pid) )
+            sample_maps (procs [idx].pid);
+    }
+    free (procs);
+}
+
+/*
+ * Once the server is ready, while we may still be root: what it mapped
+ * during initialisation is most of the working set.
+ */
+void
+prefetch_server (pid_t server)
+{
+    if ( !u_prefetch )
+        return;
+
+    if ( sample_maps (server) )
+        debugx ("prefetch: %d files in the working set after server start", seen.count);
+    else
+        debugx ("prefetch: server %d is not ours to sample, its files are not recorded", (int) server);
+}
+
+void
+prefetch_record (pid_t server, pid_t client)
+{
+    if ( !u_prefetch )
+        return;
+
+    if ( replayed != -1 )
+        debugx ("prefetch: %d files read ahead in %lld us", replayed, replay_time);
+
+    roots [0] = server;
+    roots [1] = client;
+    server_blind = False;
+    next_sample = mono_ms ();
+    window_end = next_sample + SAMPLE_WINDOW;
+}
+
+/* When the main loop should call prefetch_sample (), -1 for never */
+long long
+prefetch_deadline (void)
+{
+    return next_sample;
+}
+
+void
+prefetch_sample (void)
+{
+    char path [64];
+    long long start;
+
+    if ( next_sample == -1 )
+        return;
+
+    if ( walk == -1 ) {
+        snprintf (path, sizeof (path), "/proc/%d/task/%d/children", (int) getpid (), (int) getpid ());
+        walk = access (path, R_OK) == 0;
+    }
+
+    start = mono_us ();
+    if ( walk )
+        sample_tree ();
+    else
+        sample_all ();
+
+    next_sample = mono_ms () + SAMPLE_INTERVAL;
+    if ( next_sample > window_end || seen.count == PREFETCH_FILES )
+        next_sample = -1;
+
+    debugx ("prefetch: %d files in the working set, sampled in %lld us", seen.count, mono_us () - start);
+}
+
+/*
+ * Called after the privileges are dropped: the profile belongs to the user.
+ */
+void
+prefetch_save (uid_t uid)
+{
+    char path [PATH_MAX], temp [PATH_MAX + 12], *dir;
+    FILE *out;
+    int fd, idx;
+
+    /* A session too short to sample keeps the last profile */
+    if ( seen.count == 0 || geteuid () != uid || !profile_path (path, sizeof (path)) )
+        return;
+
+    /* ~/.cache may not be there yet */
+    dir = strrchr (path, '/');
+    *dir = '\0';
+    if ( mkdir (path, 0700) == -1 && errno != EEXIST ) {
+        debug ("prefetch: could not create %s", path);
+        return;
+    }
+    *dir = '/';
+
+    snprintf (temp, sizeof (temp), "%s.%d", path, (int) getpid ());
+    fd = open (temp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    out = fd != -1 ? fdopen (fd, "w") : NULL;
+    if ( out == NULL ) {
+        debug ("prefetch: could not create %s", temp);
+        if ( fd != -1 )
+            close (fd);
+        return;
+    }
+
+    for ( idx = 0; idx < seen.count; idx++ )
+        fprintf (out, "%s\n", seen.files [idx]);
+
+    if ( fclose (out) != 0 || rename (temp, path) == -1 ) {
+        debug ("prefetch: could not write %s", path);
+        unlink (temp);
+        return;
+    }
+    debugx ("prefetch: working set of %d files stored in %s", seen.count, path);
+}
+
+void
+prefetch_free (void)
+{
+    set_clear (&seen);
+    next_sample = -1;
+}
@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _PREFETCH_H
+#define _PREFETCH_H
+
+#include <sys/types.h>
+
+
+void prefetch_start (uid_t uid);
+void prefetch_server (pid_t server);
+void prefetch_record (pid_t server, pid_t client);
+long long prefetch_deadline (void);
+void prefetch_sample (void);
+void prefetch_save (uid_t uid);
+void prefetch_free (void);
+
+
+#endif  /* _PREFETCH_H */
@@ -0,0 +1,93 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/*
+ * xinit-gate.so - where an early client waits for the X server
+ *
+ * Preloaded by gate_handoff () into the session, with LD_BIND_NOW set:
+ * when this constructor runs, ld.so has mapped and bound the program and
+ * all its libraries. It puts LD_PRELOAD and LD_BIND_NOW back the way they
+ * were, blocks on the gate until xinit sends DISPLAY and WINDOWPATH, and
+ * lets main () run. EOF without them means the server never came up.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+
+#define GATE_MAX  4096  /* as in src/gate.c */
+
+
+static char envbuf [GATE_MAX + 1];  /* putenv () keeps pointers into it */
+
+
+static void
+restore (const char *name, const char *saved)
+{
+    const char *value = getenv (saved);
+
+    if ( value == NULL )
+        return;
+
+    if ( *value != '\0' )
+        setenv (name, value, 1);
+    else
+        unsetenv (name);
+    unsetenv (saved);
+}
+
+__attribute__ ((constructor))
+static void
+gate (void)
+{
+    const char *env;
+    char *p, *end;
+    ssize_t count;
+    int fd, len = 0;
+
+    restore ("LD_PRELOAD", "XINIT_GATE_PRELOAD");
+    restore ("LD_BIND_NOW", "XINIT_GATE_BIND_NOW");
+
+    env = getenv ("XINIT_GATE_FD");
+    if ( env == NULL )
+        return;
+
+    fd = atoi (env);
+    unsetenv ("XINIT_GATE_FD");
+
+    while ( len < GATE_MAX ) {
+        count = read (fd, envbuf + len, GATE_MAX - len);
+        if ( count == -1 && errno == EINTR )
+            continue;
+        if ( count <= 0 )
+            break;
+
+        len += count;
+    }
+    close (fd);
+
+    if ( len == 0 )
+        _exit (EXIT_FAILURE);
+
+    envbuf [len] = '\0';
+    for ( p = envbuf, end = envbuf + len; p < end; p += strlen (p) + 1 ) {
+        if ( strchr (p, '=') != NULL )
+            putenv (p);
+    }
+}
@@ -0,0 +1,455 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* pipe2 */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>  /* offsetof */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>  /* chmod */
+#include <sys/un.h>
+
+#include "util.h"
+#include "loop.h"
+#include "ready.h"
+#include "trace.h"
+
+
+#define SOCKET_PATH  "/tmp/.X11-unix/X%d"
+
+/* The socket probe backs off from PROBE_MIN to PROBE_MAX milliseconds;
+ * it only matters when neither -displayfd nor SIGUSR1 wakes us up */
+#define PROBE_MIN    5
+#define PROBE_MAX    100
+
+#define LISTEN_BACKLOG  SOMAXCONN
+
+
+static int pipefd [2] = { -1, -1 };
+static char fdbuf [12];     /* -displayfd argument */
+static char numbuf [16];    /* display number written by the server */
+static int numlen = 0;
+
+/*
+ * With 'listenfd' the display sockets are ours: bound before the fork and
+ * handed to the server with -listenfd, so clients queue in the backlog
+ * until it accepts. The socket probe would only ever reach ourselves;
+ * instead a connection setup is queued on our own socket as soon as the
+ * server runs, and its answer tells us that the server serves clients.
+ */
+static int listenfds [2] = { -1, -1 };  /* abstract one first */
+static char listenbuf [2][12];          /* -listenfd arguments */
+static char socket_path [sizeof (((struct sockaddr_un *) 0)->sun_path)];
+static int probefd = -1;
+static int listening = False;
+
+
+/*
+ * Code
+ */
+
+static int
+display_number (void)
+{
+    const char *p;
+
+    if ( u_display == NULL )
+        return -1;
+
+    p = strrchr (u_display, ':');
+    if ( p == NULL || p [1] < '0' || p [1] > '9' )
+        return -1;
+
+    return atoi (p + 1);
+}
+
+static socklen_t
+socket_address (struct sockaddr_un *addr, int num, int abstract)
+{
+    memset (addr, 0, sizeof (*addr));
+    addr->sun_family = AF_UNIX;
+    snprintf (addr->sun_path + abstract, sizeof (addr->sun_path) - abstract, SOCKET_PATH, num);
+    return offsetof (struct sockaddr_un, sun_path) + abstract + strlen (addr->sun_path + abstract);
+}
+
+/* Stale when nobody answers on it any more */
+static int
+bind_socket (int fd, struct sockaddr_un *addr, socklen_t len, int abstract)
+{
+    int probe, result;
+
+    if ( bind (fd, (struct sockaddr *) addr, len) == 0 )
+        return True;
+
+    if ( errno != EADDRINUSE || abstract )
+        return False;
+
+    probe = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( probe == -1 )
+        return False;
+
+    result = connect (probe, (struct sockaddr *) addr, len);
+    close (probe);
+    if ( result == 0 || errno != ECONNREFUSED )
+        return False;
+
+    debugx ("removing stale socket %s", addr->sun_path);
+    unlink (addr->sun_path);
+    return bind (fd, (struct sockaddr *) addr, len) == 0;
+}
+
+static void
+listen_display (int num)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int abstract, fd, count = 0;
+
+    if ( num < 0 )
+        return;
+
+    for ( abstract = 1; abstract >= 0; abstract-- ) {
+        len = socket_address (&addr, num, abstract);
+
+        fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if ( fd == -1 )
+            break;
+
+        /* No socket directory: the server makes it, with its own socket */
+        if ( !bind_socket (fd, &addr, len, abstract) ) {
+            debug ("could not bind %s%s", abstract ? "@" : "", addr.sun_path + abstract);
+            close (fd);
+            continue;
+        }
+
+        if ( !abstract ) {
+            snprintf (socket_path, sizeof (socket_path), "%s", addr.sun_path);
+            chmod (socket_path, 0777);
+        }
+
+        if ( listen (fd, LISTEN_BACKLOG) == -1 ) {
+            debug ("could not listen on %s%s", abstract ? "@" : "", addr.sun_path + abstract);
+            close (fd);
+            continue;
+        }
+        listenfds [count] = fd;
+        snprintf (listenbuf [count], sizeof (listenbuf [count]), "%d", fd);
+        count++;
+    }
+
+    listening = count != 0;
+    if ( listening )
+        debugx ("listening on display :%d for the server (%d sockets)", num, count);
+}
+
+int
+ready_prepare (void)
+{
+    /* A restarted server gets the file system socket anew */
+    if ( *socket_path != '\0' ) {
+        unlink (socket_path);
+        *socket_path = '\0';
+    }
+
+    if ( u_listenfd )
+        listen_display (display_number ());
+
+    if ( !u_displayfd )
+        return True;
+
+    if ( pipe2 (pipefd, O_CLOEXEC) == -1 ) {
+        /* Not fatal: SIGUSR1 and the socket probe still work */
+        debug ("could not create displayfd pipe");
+        pipefd [0] = pipefd [1] = -1;
+        return True;
+    }
+    snprintf (fdbuf, sizeof (fdbuf), "%d", pipefd [1]);
+    numlen = 0;
+    return True;
+}
+
+char *
+ready_displayfd (void)
+{
+    if ( pipefd [1] == -1 )
+        return NULL;
+
+    return fdbuf;
+}
+
+/* The idx-th -listenfd argument, NULL past the last */
+char *
+ready_listenfd (int idx)
+{
+    if ( idx < 0 || idx >= 2 || listenfds [idx] == -1 )
+        return NULL;
+
+    return listenbuf [idx];
+}
+
+void
+ready_child (void)
+{
+    int idx;
+
+    /* The write end has to survive exec, and so do the sockets */
+    if ( pipefd [1] != -1 )
+        fcntl (pipefd [1], F_SETFD, 0);
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( listenfds [idx] != -1 )
+            fcntl (listenfds [idx], F_SETFD, 0);
+    }
+}
+
+/*
+ * Queue a connection setup on our own socket: little-endian, protocol
+ * 11.0, no authorization. Accepted or refused, any answer comes from a
+ * server that serves clients.
+ */
+static void
+open_probe (void)
+{
+    static const unsigned char setup [12] = { 'l', 0, 11, 0, 0, 0 };
+    struct sockaddr_un addr;
+    socklen_t len = sizeof (addr);
+
+    if ( getsockname (listenfds [0], (struct sockaddr *) &addr, &len) == -1 )
+        return;
+
+    probefd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( probefd == -1 )
+        return;
+
+    if ( connect (probefd, (struct sockaddr *) &addr, len) == -1 ||
+         write (probefd, setup, sizeof (setup)) != sizeof (setup) ) {
+        debug ("could not queue a connection on the display socket");
+        close (probefd);
+        probefd = -1;
+    }
+}
+
+void
+ready_parent (void)
+{
+    /* Close our copy of the write end so that we see EOF when the server
+     * exits without writing anything */
+    if ( pipefd [1] != -1 ) {
+        close (pipefd [1]);
+        pipefd [1] = -1;
+    }
+
+    if ( listening )
+        open_probe ();
+}
+
+static int
+probe_socket (int num)
+{
+    struct sockaddr_un addr;
+    socklen_t len;
+    int fd, result, abstract;
+
+    /* Our own sockets always accept */
+    if ( num < 0 || listening )
+        return False;
+
+    /* Try the abstract namespace first, then the file system socket */
+    for ( abstract = 1; abstract >= 0; abstract-- ) {
+        len = socket_address (&addr, num, abstract);
+
+        fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if ( fd == -1 )
+            return False;
+
+        result = connect (fd, (struct sockaddr *) &addr, len);
+        close (fd);
+
+        /* EAGAIN means the listen backlog is full, so somebody listens */
+        if ( result == 0 || errno == EAGAIN )
+            return True;
+    }
+    return False;
+}
+
+static int
+read_display (void)
+{
+    ssize_t count;
+    char display [16];
+
+    count = read (pipefd [0], numbuf + numlen, sizeof (numbuf) - 1 - numlen);
+    if ( count == -1 && (errno == EINTR || errno == EAGAIN) )
+        return False;
+
+    if ( count <= 0 ) {
+        /* EOF: the server closed the pipe without telling us anything */
+        debugx ("displayfd closed by the server");
+        loop_unwatch_fd (pipefd [0]);
+        close (pipefd [0]);
+        pipefd [0] = -1;
+        return False;
+    }
+
+    numlen += count;
+    numbuf [numlen] = '\0';
+    if ( strchr (numbuf, '\n') == NULL && numlen < (int) sizeof (numbuf) - 1 )
+        return False;
+
+    snprintf (display, sizeof (display), ":%d", atoi (numbuf));
+    if ( u_display == NULL || strcmp (u_display, display) != 0 ) {
+        debugx ("server picked display %s", display);
+        if ( !set_display (display) )
+            error_no_memory ();
+    }
+    return True;
+}
+
+Ready
+ready_wait (pid_t pid, int *status)
+{
+    LoopEvent ev;
+    long long deadline, now;
+    int probe = PROBE_MIN;
+
+    deadline = mono_ms () + u_server_timeout;
+
+    if ( pipefd [0] != -1 && !loop_watch_fd (pipefd [0]) )
+        return ReadyTimeout;
+
+    if ( probefd != -1 && !loop_watch_fd (probefd) )
+        return ReadyTimeout;
+
+    for ( ;; ) {
+        now = mono_ms ();
+        if ( now >= deadline )
+            break;
+
+        switch (loop_wait (MIN (now + probe, deadline), &ev)) {
+        case LoopFd:
+            if ( ev.fd == pipefd [0] && read_display () ) {
+                trace_instant ("displayfd");
+                return ReadyDisplayFd;
+            }
+            if ( ev.fd == probefd ) {
+                trace_instant ("listenfd answers");
+                return ReadyListen;
+            }
+            break;
+
+        case LoopSignal:
+            if ( ev.signo == SIGUSR1 ) {
+                trace_instant ("SIGUSR1");
+                return ReadySignal;
+            }
+
+            errorx ("interrupted by signal %d", ev.signo);
+            return ReadyInterrupted;
+
+        case LoopExit:
+            if ( ev.pid != pid )
+                break;
+
+            *status = ev.status;
+            errorx ("server exited before accepting connections");
+            return ReadyDied;
+
+        case LoopTimeout:
+            if ( probe_socket (display_number ()) ) {
+                trace_instant ("socket accepts");
+                return ReadySocket;
+            }
+
+            probe = MIN (probe << 1, PROBE_MAX);
+            break;
+
+        default:
+            return ReadyTimeout;
+        }
+    }
+
+    errorx ("server not ready after %d ms", u_server_timeout);
+    return ReadyTimeout;
+}
+
+const char *
+ready_name (Ready how)
+{
+    switch (how) {
+    case ReadyDisplayFd:
+        return "displayfd";
+    case ReadySignal:
+        return "SIGUSR1";
+    case ReadySocket:
+        return "socket";
+    case ReadyListen:
+        return "listenfd";
+    case ReadyDied:
+        return "died";
+    case ReadyInterrupted:
+        return "interrupted";
+    default:
+        return "timeout";
+    }
+}
+
+/* The server has its own copies of the sockets by now */
+void
+ready_close (void)
+{
+    int idx;
+
+    if ( pipefd [0] != -1 )
+        loop_unwatch_fd (pipefd [0]);
+
+    if ( probefd != -1 ) {
+        loop_unwatch_fd (probefd);
+        close (probefd);
+        probefd = -1;
+    }
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( pipefd [idx] != -1 ) {
+            close (pipefd [idx]);
+            pipefd [idx] = -1;
+        }
+        if ( listenfds [idx] != -1 ) {
+            close (listenfds [idx]);
+            listenfds [idx] = -1;
+        }
+    }
+    listening = False;
+}
+
+/* At the end of the session: the server leaves sockets it was given */
+void
+ready_release (void)
+{
+    if ( *socket_path != '\0' ) {
+        unlink (socket_path);
+        *socket_path = '\0';
+    }
+}
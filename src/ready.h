@@ -0,0 +1,46 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _READY_H
+#define _READY_H
+
+#include <sys/types.h>  /* pid_t */
+
+
+typedef enum {
+    ReadyInterrupted = -2,  /* a supervised signal arrived first */
+    ReadyDied,              /* the server exited before it was ready */
+    ReadyTimeout,           /* 'server-timeout' expired */
+    ReadyDisplayFd,         /* the server wrote its display number to -displayfd */
+    ReadySignal,            /* the server sent SIGUSR1 */
+    ReadySocket,            /* the display socket accepted a connection */
+    ReadyListen             /* the server answered on the socket we gave it */
+} Ready;
+
+
+int ready_prepare (void);
+char * ready_displayfd (void);
+char * ready_listenfd (int idx);
+void ready_child (void);
+void ready_parent (void);
+Ready ready_wait (pid_t pid, int *status);
+const char * ready_name (Ready how);
+void ready_close (void);
+void ready_release (void);
+
+
+#endif  /* _READY_H */
@@ -0,0 +1,148 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "trace.h"
+#include "restart.h"
+
+
+#define RESTART_WINDOW       60000   /* ms the breaker looks back */
+#define RESTART_STABLE       30000   /* ms a client has to stay up to reset the backoff */
+#define RESTART_BACKOFF_MAX  30000   /* ms */
+
+
+/*
+ * Restart policy, on with 'restart-max': a client that crashes (fails or
+ * is killed by a signal) is started again against the running server,
+ * whose connection we keep open so that it does not reset. The delay
+ * starts at 'restart-backoff' ms and doubles with every crash in a row;
+ * more than 'restart-max' crashes within RESTART_WINDOW trip the breaker
+ * and the session ends as it always did. Only a server that dies is
+ * started again too.
+ */
+static long long crashes [RESTART_MAX + 1];  /* ring of crash times */
+static int ncrashes = 0;
+static int streak = 0;                       /* crashes without a stable run */
+static long long started = 0;                /* ms, the client's last start */
+static long long crashed = 0;                /* us, the pending restart's crash */
+static int server_pending = False;
+static int client_restarts = 0;
+static int server_restarts = 0;
+static long long restored = 0;               /* ms, the last restart */
+
+
+/*
+ * Code
+ */
+
+static int
+recent_crashes (long long now)
+{
+    int idx, count = 0, size = MIN (ncrashes, (int) countof (crashes));
+
+    for ( idx = 0; idx < size; idx++ ) {
+        if ( now - crashes [idx] < RESTART_WINDOW )
+            count++;
+    }
+    return count;
+}
+
+/*
+ * The client (or with 'server' the server) exited with 'status': the
+ * milliseconds to wait before the restart, or -1 to end the session.
+ */
+long long
+restart_delay (int status, int server)
+{
+    long long now, delay;
+    const char *who = server ? "X server" : "client";
+    int idx, count;
+
+    if ( u_restart_max == 0 )
+        return -1;
+
+    /* A client that exits cleanly ends the session */
+    if ( !server && WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS )
+        return -1;
+
+    now = mono_ms ();
+    crashes [ncrashes++ % countof (crashes)] = now;
+
+    count = recent_crashes (now);
+    if ( count > u_restart_max ) {
+        errorx ("%s crashed %d times within %d s, giving up", who, count, RESTART_WINDOW / 1000);
+        return -1;
+    }
+
+    if ( now - started >= RESTART_STABLE )
+        streak = 0;
+
+    delay = u_restart_backoff;
+    for ( idx = 0; idx < streak && delay < RESTART_BACKOFF_MAX; idx++ )
+        delay *= 2;
+
+    delay = MIN (delay, RESTART_BACKOFF_MAX);
+    streak++;
+
+    crashed = mono_us ();
+    server_pending = server;
+    errorx ("%s crashed (status %d), restarting %sin %lld ms", who, status,
+        server ? "server and client " : "", delay);
+    return delay;
+}
+
+/* The client runs (again) */
+void
+restart_started (void)
+{
+    started = mono_ms ();
+    if ( crashed == 0 )
+        return;
+
+    if ( server_pending )
+        server_restarts++;
+    else
+        client_restarts++;
+
+    restored = started;
+    trace_span (server_pending ? "server restart" : "client restart", crashed);
+    errorx ("client restored %lld ms after the crash", (mono_us () - crashed) / 1000);
+    crashed = 0;
+}
+
+void
+restart_counts (int *server, int *client, long long *last)
+{
+    *server = server_restarts;
+    *client = client_restarts;
+    *last = restored;
+}
+
+void
+restart_report (void)
+{
+    if ( client_restarts != 0 || server_restarts != 0 )
+        errorx ("%d client restarts, %d server restarts", client_restarts, server_restarts);
+}
@@ -0,0 +1,307 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* timerfd, O_CLOEXEC */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "loop.h"
+#include "sample.h"
+
+
+#define SAMPLE_MAGIC    "XSMP"
+#define SAMPLE_VERSION  1
+
+#define KIND_SAMPLE     0
+#define KIND_EXIT       1
+
+
+/*
+ * Resource time series of the server and the client tree, on with
+ * 'sample-file': every 'sample-interval' ms one record per tree sums
+ * /proc/<pid>/stat and smaps_rollup over the processes of its process
+ * group, and every exit adds a record with what wait4 () reported.
+ *
+ * The file is a Header and then Records, host byte order:
+ *
+ *   python3: struct.iter_unpack ("qBBHiQQQQQ", data [16:])
+ *
+ * A timerfd drained by the event loop drives it: whichever loop_wait ()
+ * runs keeps sampling, and nothing else waits on it.
+ */
+typedef struct {
+    char magic [4];
+    uint32_t version;
+    uint32_t record;      /* sizeof (Record) */
+    uint32_t interval;    /* ms */
+} Header;
+
+typedef struct {
+    int64_t ms;           /* since the session started */
+    uint8_t tree;         /* SampleTree */
+    uint8_t kind;         /* KIND_* */
+    uint16_t procs;       /* processes summed up, 1 for an exit */
+    int32_t status;       /* an exit's wait status */
+    uint64_t utime_us;
+    uint64_t stime_us;
+    uint64_t rss_kb;      /* an exit's peak RSS */
+    uint64_t pss_kb;
+    uint64_t swap_kb;
+} Record;
+
+static const char * const tree_names [] = { "server", "client" };
+
+static int sample_fd = -1;
+static int timerfd = -1;
+static long long started;     /* ms */
+static long ticks;            /* clock ticks per second */
+static pid_t groups [2] = { -1, -1 };
+
+
+/*
+ * Code
+ */
+
+static int
+read_file (const char *path, char *buf, int size)
+{
+    ssize_t count;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 )
+        return False;
+
+    count = read (fd, buf, size - 1);
+    close (fd);
+    if ( count < 0 )
+        return False;
+
+    buf [count] = '\0';
+    return True;
+}
+
+static void
+emit (const Record *records, int count)
+{
+    ssize_t len = count * sizeof (Record);
+
+    if ( sample_fd != -1 && write (sample_fd, records, len) != len )
+        debug ("could not write samples");
+}
+
+/* Pss and Swap of one process; kernel threads and the gone have none */
+static void
+add_smaps (int pid, Record *rec)
+{
+    char path [64], buf [2048], *line, *next;
+
+    snprintf (path, sizeof (path), "/proc/%d/smaps_rollup", pid);
+    if ( !read_file (path, buf, sizeof (buf)) )
+        return;
+
+    for ( line = buf; line != NULL; line = next ) {
+        next = strchr (line, '\n');
+        if ( next != NULL )
+            next++;
+
+        if ( strncmp (line, "Pss:", 4) == 0 )
+            rec->pss_kb += strtoull (line + 4, NULL, 10);
+        else if ( strncmp (line, "Swap:", 5) == 0 )
+            rec->swap_kb += strtoull (line + 5, NULL, 10);
+    }
+}
+
+/* One pass over /proc for both trees: the server and the client each
+ * lead a process group of their own */
+static void
+sample (void)
+{
+    Record records [2];
+    char path [64], buf [1024], *p;
+    unsigned long utime, stime;
+    struct dirent *entry;
+    long rss, page_kb;
+    int pid, pgrp, tree;
+    DIR *dir;
+
+    memset (records, 0, sizeof (records));
+    for ( tree = 0; tree < 2; tree++ ) {
+        records [tree].ms = mono_ms () - started;
+        records [tree].tree = tree;
+        records [tree].kind = KIND_SAMPLE;
+    }
+
+    dir = opendir ("/proc");
+    if ( dir == NULL )
+        return;
+
+    page_kb = sysconf (_SC_PAGESIZE) / 1024;
+    while ( (entry = readdir (dir)) != NULL ) {
+        pid = atoi (entry->d_name);
+        if ( pid <= 0 )
+            continue;
+
+        snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+        if ( !read_file (path, buf, sizeof (buf)) )
+            continue;
+
+        /* The name may hold anything, the fields follow its last ')' */
+        p = strrchr (buf, ')');
+        if ( p == NULL || sscanf (p + 2, "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &pgrp, &utime, &stime, &rss) != 4 )
+            continue;
+
+        for ( tree = 0; tree < 2 && (groups [tree] <= 0 || pgrp != groups [tree]); tree++ )
+            ;  /* NOP */
+        if ( tree == 2 )
+            continue;
+
+        records [tree].procs++;
+        records [tree].utime_us += utime * 1000000ULL / ticks;
+        records [tree].stime_us += stime * 1000000ULL / ticks;
+        records [tree].rss_kb += rss * page_kb;
+        add_smaps (pid, records + tree);
+    }
+    closedir (dir);
+
+    emit (records, 2);
+}
+
+static void
+tick (int fd)
+{
+    uint64_t expirations;
+
+    /* Missed ticks are not made up for */
+    if ( read (fd, &expirations, sizeof (expirations)) == -1 )
+        return;
+
+    sample ();
+}
+
+static void
+sample_start (void)
+{
+    struct itimerspec its;
+    Header header;
+
+    sample_fd = open (u_sample_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if ( sample_fd == -1 ) {
+        error ("could not open sample file %s", u_sample_file);
+        return;
+    }
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, SAMPLE_MAGIC, sizeof (header.magic));
+    header.version = SAMPLE_VERSION;
+    header.record = sizeof (Record);
+    header.interval = u_sample_interval;
+    if ( write (sample_fd, &header, sizeof (header)) != sizeof (header) ) {
+        error ("could not write %s", u_sample_file);
+        close (sample_fd);
+        sample_fd = -1;
+        return;
+    }
+
+    ticks = sysconf (_SC_CLK_TCK);
+    timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if ( timerfd == -1 ) {
+        error ("could not create the sample timer");
+        return;
+    }
+
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = its.it_interval.tv_sec = u_sample_interval / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (u_sample_interval % 1000) * 1000000L;
+    if ( timerfd_settime (timerfd, 0, &its, NULL) == -1 || !loop_drain_fd (timerfd, tick) ) {
+        close (timerfd);
+        timerfd = -1;
+        return;
+    }
+    debugx ("sampling every %d ms into %s", u_sample_interval, u_sample_file);
+}
+
+/*
+ * Server and client run: sampling starts with the first call, later ones
+ * follow restarts. -1 is for one that is gone.
+ */
+void
+sample_running (pid_t server, pid_t client)
+{
+    groups [SampleServer] = server;
+    groups [SampleClient] = client;
+
+    if ( u_sample_file == NULL || started != 0 )
+        return;
+
+    started = mono_ms ();
+    sample_start ();
+}
+
+/* A reaped server or client: what it used, whether sampling or not */
+void
+sample_exited (SampleTree tree, int status, const struct rusage *ru)
+{
+    Record rec;
+
+    debugx ("%s exited with status %d: %ld.%03ld s user, %ld.%03ld s system, peak RSS %ld KiB",
+        tree_names [tree], status,
+        (long) ru->ru_utime.tv_sec, (long) ru->ru_utime.tv_usec / 1000,
+        (long) ru->ru_stime.tv_sec, (long) ru->ru_stime.tv_usec / 1000, ru->ru_maxrss);
+
+    if ( sample_fd == -1 )
+        return;
+
+    memset (&rec, 0, sizeof (rec));
+    rec.ms = mono_ms () - started;
+    rec.tree = tree;
+    rec.kind = KIND_EXIT;
+    rec.procs = 1;
+    rec.status = status;
+    rec.utime_us = ru->ru_utime.tv_sec * 1000000ULL + ru->ru_utime.tv_usec;
+    rec.stime_us = ru->ru_stime.tv_sec * 1000000ULL + ru->ru_stime.tv_usec;
+    rec.rss_kb = ru->ru_maxrss;
+    emit (&rec, 1);
+}
+
+void
+sample_close (void)
+{
+    if ( timerfd != -1 ) {
+        loop_unwatch_fd (timerfd);
+        close (timerfd);
+        timerfd = -1;
+    }
+    if ( sample_fd != -1 ) {
+        close (sample_fd);
+        sample_fd = -1;
+    }
+}
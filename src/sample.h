@@ -0,0 +1,36 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _SAMPLE_H
+#define _SAMPLE_H
+
+#include <sys/types.h>
+#include <sys/resource.h>  /* struct rusage */
+
+
+typedef enum {
+    SampleServer,
+    SampleClient
+} SampleTree;
+
+
+void sample_running (pid_t server, pid_t client);
+void sample_exited (SampleTree tree, int status, const struct rusage *ru);
+void sample_close (void);
+
+
+#endif  /* _SAMPLE_H */
@@ -0,0 +1,242 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "loop.h"
+#include "seat.h"
+
+
+#define SEAT_MAX  16
+
+
+/*
+ * Multi-seat: every 'seat' line of the config ("seat1 -novtswitch") runs
+ * its own server and client. The parent does the shared work once (config,
+ * identity, device inventory), then forks one child per seat that goes on
+ * like a single-seat xinit restricted to the devices udev tagged for it,
+ * and stays behind as the supervisor of those children.
+ */
+typedef struct {
+    char *name;
+    char *args;       /* extra server arguments */
+    pid_t pid;
+    int status;
+} Seat;
+
+
+static Seat seats [SEAT_MAX];
+static int nseats = 0;
+static int current = -1;
+
+
+/*
+ * Code
+ */
+
+int
+seat_add (const char *value)
+{
+    Seat *seat;
+    const char *p;
+    int len;
+
+    if ( nseats == SEAT_MAX ) {
+        errorx ("too many seats, at most %d", SEAT_MAX);
+        return False;
+    }
+
+    for ( p = value; *p != '\0' && *p != ' ' && *p != '\t'; p++ )
+        ;  /* NOP */
+
+    /* It names cgroups and cache files */
+    len = p - value;
+    if ( len == 0 || *value == '.' || memchr (value, '/', len) != NULL ) {
+        errorx ("invalid seat name '%.*s'", len, value);
+        return False;
+    }
+
+    seat = seats + nseats;
+    seat->name = x_malloc (len + 1);
+    if ( seat->name == NULL )
+        return False;
+
+    memcpy (seat->name, value, len);
+    seat->name [len] = '\0';
+
+    seat->args = s_dup (p);
+    if ( seat->args == NULL ) {
+        free (seat->name);
+        return False;
+    }
+    seat->pid = -1;
+    nseats++;
+    return True;
+}
+
+int
+seat_count (void)
+{
+    return nseats;
+}
+
+/* The seat this process runs, NULL for single-seat mode and the supervisor */
+const char *
+seat_name (void)
+{
+    return current != -1 ? seats [current].name : NULL;
+}
+
+char *
+seat_args (void)
+{
+    return current != -1 ? seats [current].args : NULL;
+}
+
+/*
+ * Returns True in a seat child, False in the supervisor and DIE when not
+ * even one seat could be started.
+ */
+int
+seat_fork (void)
+{
+    static char name [64];
+    int idx, started = 0;
+
+    fflush (stderr);
+
+    for ( idx = 0; idx < nseats; idx++ ) {
+        seats [idx].pid = fork ();
+        if ( seats [idx].pid == 0 ) {
+            current = idx;
+            snprintf (name, sizeof (name), "%s[%s]", prog_name, seats [idx].name);
+            prog_name = name;
+            return True;
+        }
+        if ( seats [idx].pid == -1 ) {
+            error ("could not start %s", seats [idx].name);
+            continue;
+        }
+        debugx ("%s started: pid=%d", seats [idx].name, seats [idx].pid);
+        started++;
+    }
+    return started != 0 ? False : DIE;
+}
+
+static Seat *
+find_seat (pid_t pid)
+{
+    int idx;
+
+    for ( idx = 0; idx < nseats; idx++ ) {
+        if ( seats [idx].pid == pid )
+            return seats + idx;
+    }
+    return NULL;
+}
+
+static void
+signal_seats (int signo)
+{
+    int idx;
+
+    for ( idx = 0; idx < nseats; idx++ ) {
+        if ( seats [idx].pid > 0 && kill (seats [idx].pid, signo) == -1 && errno != ESRCH )
+            error ("could not signal %s", seats [idx].name);
+    }
+}
+
+/*
+ * The supervisor: wait for every seat, passing termination signals on.
+ * Every seat shuts its own server down; we succeed only if they all did.
+ */
+int
+seat_supervise (void)
+{
+    LoopEvent ev;
+    Seat *seat;
+    int idx, running = 0, failed = 0;
+
+    if ( !loop_init () ) {
+        signal_seats (SIGTERM);
+        return False;
+    }
+
+    for ( idx = 0; idx < nseats; idx++ ) {
+        if ( seats [idx].pid > 0 && loop_watch_pid (seats [idx].pid) )
+            running++;
+    }
+
+    while ( running != 0 ) {
+        switch (loop_wait (-1, &ev)) {
+        case LoopExit:
+            seat = find_seat (ev.pid);
+            if ( seat == NULL )
+                break;
+
+            seat->pid = -1;
+            seat->status = ev.status;
+            running--;
+
+            if ( !WIFEXITED (ev.status) || WEXITSTATUS (ev.status) != EXIT_SUCCESS ) {
+                errorx ("%s failed: status %d", seat->name, ev.status);
+                failed++;
+            } else
+                debugx ("%s finished", seat->name);
+            break;
+
+        case LoopSignal:
+            /* SIGUSR1 is meant for the seats, not for us */
+            if ( ev.signo != SIGUSR1 )
+                signal_seats (SIGTERM);
+            break;
+
+        case LoopError:
+            signal_seats (SIGTERM);
+            return False;
+
+        default:
+            break;
+        }
+    }
+
+    loop_close ();
+    return failed == 0;
+}
+
+void
+seat_free (void)
+{
+    int idx;
+
+    for ( idx = 0; idx < nseats; idx++ ) {
+        free (seats [idx].name);
+        free (seats [idx].args);
+    }
+    nseats = 0;
+}
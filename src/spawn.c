@@ -0,0 +1,362 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* syscall, pipe2, O_PATH */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "util.h"
+#include "spawn.h"
+
+
+/* <linux/sched.h> clashes with <sched.h>, the ABI is all we need */
+#define SPAWN_CLONE_PIDFD        0x00001000
+#define SPAWN_CLONE_INTO_CGROUP  0x200000000ULL
+
+#ifndef AT_EMPTY_PATH
+# define AT_EMPTY_PATH     0x1000
+#endif
+
+
+struct spawn_clone_args {
+    uint64_t flags;
+    uint64_t pidfd;
+    uint64_t child_tid;
+    uint64_t parent_tid;
+    uint64_t exit_signal;
+    uint64_t stack;
+    uint64_t stack_size;
+    uint64_t tls;
+    uint64_t set_tid;
+    uint64_t set_tid_size;
+    uint64_t cgroup;
+};
+
+/* What the child reports through the exec-error pipe; nothing at all
+ * (EOF once exec closes the pipe) means success */
+typedef struct {
+    int stage;            /* SpawnSetupFailed or SpawnExecFailed */
+    int err;
+} SpawnError;
+
+enum {
+    SpawnSetupFailed = 1,
+    SpawnExecFailed
+};
+
+
+/* clone3 () is off for good once the kernel or seccomp refused it, and
+ * CLONE_INTO_CGROUP (Linux 5.7) once it was refused */
+static int have_clone3 = True;
+static int have_into_cgroup = True;
+
+extern char **environ;
+
+
+/*
+ * Code
+ */
+
+void
+spawn_init (Spawn *sp, char **argv)
+{
+    memset (sp, 0, sizeof (*sp));
+    sp->argv = argv;
+    sp->fd = -1;
+    sp->errpipe [0] = sp->errpipe [1] = -1;
+    sp->cgroup = -1;
+    sp->pid = -1;
+}
+
+static int
+open_path (Spawn *sp, const char *path)
+{
+    if ( snprintf (sp->path, sizeof (sp->path), "%s", path) >= (int) sizeof (sp->path) )
+        return False;
+
+    sp->fd = open (path, O_PATH | O_CLOEXEC);
+    if ( sp->fd == -1 )
+        return False;
+
+    debugx ("spawn: %s resolved to %s", sp->argv [0], sp->path);
+    return True;
+}
+
+static int
+lookup (Spawn *sp, const char *name)
+{
+    char candidate [PATH_MAX];
+    const char *path, *end;
+    int len;
+
+    if ( strchr (name, '/') != NULL )
+        return access (name, X_OK) == 0 && open_path (sp, name);
+
+    path = getenv ("PATH");
+    if ( path == NULL )
+        path = "/bin:/usr/bin";
+
+    for ( ; *path != '\0'; path = *end != '\0' ? end + 1 : end ) {
+        end = strchr (path, ':');
+        if ( end == NULL )
+            end = path + strlen (path);
+
+        /* An empty entry is the current directory, as for execvp () */
+        len = end - path;
+        if ( snprintf (candidate, sizeof (candidate), "%.*s%s%s", len, path,
+                       len != 0 ? "/" : "", name) >= (int) sizeof (candidate) )
+            continue;
+
+        if ( access (candidate, X_OK) == 0 )
+            return open_path (sp, candidate);
+    }
+    errno = ENOENT;
+    return False;
+}
+
+/*
+ * Decide once what gets executed: argv[0] from PATH, or the shell for a
+ * script that is only readable (how xinitrc files are run).
+ */
+int
+spawn_resolve (Spawn *sp)
+{
+    if ( sp->fd != -1 )
+        return True;
+
+    if ( lookup (sp, sp->argv [0]) )
+        return True;
+
+    if ( sp->shell == NULL || access (sp->argv [0], R_OK) != 0 )
+        return False;
+
+    /* back it up to stuff shell in */
+    sp->argv--;
+    sp->argv [0] = (char *) sp->shell;
+    return lookup (sp, sp->shell);
+}
+
+static void
+report (Spawn *sp, int stage)
+{
+    SpawnError e;
+    ssize_t unused;
+
+    e.stage = stage;
+    e.err = errno;
+    unused = write (sp->errpipe [1], &e, sizeof (e));
+    (void) unused;
+    _exit (127);
+}
+
+static void
+join_cgroup (int dirfd)
+{
+    ssize_t unused;
+    int fd;
+
+    /* "0" moves the writer; not being let in is no reason to fail */
+    fd = openat (dirfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if ( fd != -1 ) {
+        unused = write (fd, "0", 1);
+        (void) unused;
+        close (fd);
+    }
+}
+
+static void
+child (Spawn *sp)
+{
+    char **envp;
+
+    close (sp->errpipe [0]);
+
+    if ( sp->cgroup != -1 && !sp->placed )
+        join_cgroup (sp->cgroup);
+
+    if ( sp->setup != NULL && !sp->setup (sp->data) )
+        report (sp, SpawnSetupFailed);
+
+    /* setup () may have changed our environment */
+    envp = sp->envp != NULL ? sp->envp : environ;
+
+#ifdef SYS_execveat
+    syscall (SYS_execveat, sp->fd, "", sp->argv, envp, AT_EMPTY_PATH);
+#endif
+    /* Scripts cannot run from a close-on-exec descriptor, nor do kernels
+     * before 3.19 know execveat () */
+    execve (sp->path, sp->argv, envp);
+    report (sp, SpawnExecFailed);
+}
+
+static pid_t
+clone_pidfd (Spawn *sp, int *pidfd)
+{
+#ifdef SYS_clone3
+    struct spawn_clone_args args;
+    pid_t pid;
+
+    memset (&args, 0, sizeof (args));
+    args.flags = SPAWN_CLONE_PIDFD;
+    args.pidfd = (uintptr_t) pidfd;
+    args.exit_signal = SIGCHLD;
+
+    /* The child starts out in its cgroup: nothing it does before exec
+     * is accounted to ours */
+    sp->placed = sp->cgroup != -1 && have_into_cgroup;
+    if ( sp->placed ) {
+        args.flags |= SPAWN_CLONE_INTO_CGROUP;
+        args.cgroup = sp->cgroup;
+
+        pid = syscall (SYS_clone3, &args, sizeof (args));
+        if ( pid != -1 || (errno != E2BIG && errno != EINVAL) )
+            return pid;
+
+        debug ("CLONE_INTO_CGROUP not available");
+        have_into_cgroup = False;
+        sp->placed = False;
+        args.flags &= ~SPAWN_CLONE_INTO_CGROUP;
+        args.cgroup = 0;
+    }
+
+    pid = syscall (SYS_clone3, &args, sizeof (args));
+    if ( pid != -1 || (errno != ENOSYS && errno != EPERM && errno != EINVAL) )
+        return pid;
+
+    debug ("clone3 not available, using fork");
+#endif
+    have_clone3 = False;
+    errno = ENOSYS;
+    return -1;
+}
+
+/*
+ * Start the child; it runs setup () and execs on its own. clone3 () hands
+ * us a pidfd with the child, after fork () *pidfd is -1 and the caller
+ * opens one. Only an async-signal-safe setup () may run after clone3 ():
+ * unlike fork () it leaves the locks of other threads as they were.
+ */
+pid_t
+spawn_start (Spawn *sp, int *pidfd)
+{
+    pid_t pid = -1;
+
+    *pidfd = -1;
+    if ( !spawn_resolve (sp) )
+        return -1;
+
+    if ( pipe2 (sp->errpipe, O_CLOEXEC) == -1 ) {
+        error ("could not create exec-error pipe");
+        return -1;
+    }
+
+    if ( sp->safe && have_clone3 )
+        pid = clone_pidfd (sp, pidfd);
+
+    if ( pid == -1 && !(sp->safe && have_clone3) ) {
+        *pidfd = -1;
+        sp->placed = False;
+        pid = fork ();
+    }
+
+    if ( pid == 0 )
+        child (sp);  /* no return */
+
+    close (sp->errpipe [1]);
+    sp->errpipe [1] = -1;
+    sp->pid = pid;
+
+    if ( pid == -1 ) {
+        error ("could not start %s", sp->path);
+        spawn_close (sp);
+    }
+    return pid;
+}
+
+/*
+ * Wait until the child has exec'd (True) or failed (False, errno says why;
+ * 0 if setup () failed and told so itself).
+ */
+int
+spawn_finish (Spawn *sp)
+{
+    SpawnError e;
+    ssize_t count;
+
+    do
+        count = read (sp->errpipe [0], &e, sizeof (e));
+    while ( count == -1 && errno == EINTR );
+
+    close (sp->errpipe [0]);
+    sp->errpipe [0] = -1;
+
+    if ( count != (ssize_t) sizeof (e) )
+        return True;
+
+    errno = e.stage == SpawnExecFailed ? e.err : 0;
+    return False;
+}
+
+pid_t
+spawn (Spawn *sp, int *pidfd)
+{
+    pid_t pid;
+    int err;
+
+    pid = spawn_start (sp, pidfd);
+    if ( pid == -1 || spawn_finish (sp) )
+        return pid;
+
+    /* It is about to _exit (), don't leave a zombie behind */
+    err = errno;
+    if ( *pidfd != -1 )
+        close (*pidfd);
+    *pidfd = -1;
+    waitpid (pid, NULL, 0);
+    errno = err;
+    return -1;
+}
+
+void
+spawn_close (Spawn *sp)
+{
+    int idx;
+
+    for ( idx = 0; idx < 2; idx++ ) {
+        if ( sp->errpipe [idx] != -1 ) {
+            close (sp->errpipe [idx]);
+            sp->errpipe [idx] = -1;
+        }
+    }
+    if ( sp->fd != -1 ) {
+        close (sp->fd);
+        sp->fd = -1;
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _SPAWN_H
+#define _SPAWN_H
+
+#include <sys/types.h>
+#include <limits.h>  /* PATH_MAX */
+
+
+/* Runs in the child right before exec; False makes the spawn fail */
+typedef int (*SpawnSetup) (void *data);
+
+typedef struct {
+    /* Filled in by the caller */
+    char **argv;          /* argv[0] is looked up on PATH unless it has a '/' */
+    char **envp;          /* NULL for our own environment */
+    const char *shell;    /* runs argv[0] when it is only readable, needs room at argv[-1] */
+    SpawnSetup setup;
+    void *data;
+    int safe;             /* setup is async-signal-safe, clone3 () may be used */
+    int cgroup;           /* cgroup v2 directory to start in, -1 for ours */
+
+    /* Private */
+    char path [PATH_MAX];
+    int fd;               /* O_PATH descriptor of path */
+    int errpipe [2];
+    int placed;           /* clone3 () put the child into cgroup */
+    pid_t pid;
+} Spawn;
+
+
+void spawn_init (Spawn *sp, char **argv);
+int spawn_resolve (Spawn *sp);
+pid_t spawn_start (Spawn *sp, int *pidfd);
+int spawn_finish (Spawn *sp);
+pid_t spawn (Spawn *sp, int *pidfd);
+void spawn_close (Spawn *sp);
+
+
+#endif  /* _SPAWN_H */
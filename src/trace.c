@@ -0,0 +1,173 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "util.h"
+#include "metrics.h"
+#include "trace.h"
+
+
+/*
+ * Startup phases in the Chrome trace-event "JSON Array Format", loadable
+ * in Perfetto or chrome://tracing. Every event is one O_APPEND write, so
+ * forked children (before exec) can add theirs to the same file; the
+ * format allows the closing bracket to be missing should we die early.
+ * Timestamps are CLOCK_MONOTONIC microseconds (mono_us).
+ */
+static int trace_fd = -1;
+static pid_t trace_pid;
+
+
+/*
+ * Code
+ */
+
+static void
+emit (const char *buf, int len)
+{
+    if ( len > 0 && write (trace_fd, buf, len) != len )
+        debug ("could not write trace event");
+}
+
+int
+trace_open (const char *path)
+{
+    trace_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if ( trace_fd == -1 ) {
+        error ("could not open trace file %s", path);
+        return False;
+    }
+    trace_pid = getpid ();
+    emit ("[\n", 2);
+    debugx ("tracing startup phases to %s", path);
+    return True;
+}
+
+/* A complete ("X") event from 'start' until now */
+void
+trace_span (const char *name, long long start)
+{
+    long long dur = mono_us () - start;
+    char buf [160];
+    int len;
+
+    /* The last one of each phase also goes out as a metric */
+    metrics_phase (name, dur);
+    if ( trace_fd == -1 )
+        return;
+
+    len = snprintf (buf, sizeof (buf),
+        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+        name, start, dur, (int) trace_pid, (int) getpid ());
+    emit (buf, len);
+}
+
+void
+trace_instant (const char *name)
+{
+    char buf [160];
+    int len;
+
+    if ( trace_fd == -1 )
+        return;
+
+    len = snprintf (buf, sizeof (buf),
+        "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%lld,\"pid\":%d,\"tid\":%d},\n",
+        name, mono_us (), (int) trace_pid, (int) getpid ());
+    emit (buf, len);
+}
+
+static int
+put_num (char *buf, long long num)
+{
+    char digits [24];
+    int len = 0, idx;
+
+    do {
+        digits [len++] = '0' + num % 10;
+        num /= 10;
+    } while ( num > 0 );
+
+    for ( idx = 0; idx < len; idx++ )
+        buf [idx] = digits [len - 1 - idx];
+    return len;
+}
+
+static int
+put_str (char *buf, const char *str)
+{
+    int len = strlen (str);
+
+    memcpy (buf, str, len);
+    return len;
+}
+
+/*
+ * trace_instant () for a setup () after clone3 (): async-signal-safe, so
+ * no stdio and no logging, and a failed write goes unnoticed.
+ */
+void
+trace_instant_safe (const char *name)
+{
+    char buf [160];
+    ssize_t unused;
+    int len = 0;
+
+    if ( trace_fd == -1 || strlen (name) > 64 )
+        return;
+
+    len += put_str (buf + len, "{\"name\":\"");
+    len += put_str (buf + len, name);
+    len += put_str (buf + len, "\",\"ph\":\"i\",\"s\":\"p\",\"ts\":");
+    len += put_num (buf + len, mono_us ());
+    len += put_str (buf + len, ",\"pid\":");
+    len += put_num (buf + len, trace_pid);
+    len += put_str (buf + len, ",\"tid\":");
+    len += put_num (buf + len, getpid ());
+    len += put_str (buf + len, "},\n");
+
+    unused = write (trace_fd, buf, len);
+    (void) unused;
+}
+
+void
+trace_close (void)
+{
+    char buf [128];
+    int len;
+
+    /* Only the process that opened the file finishes it */
+    if ( trace_fd == -1 || getpid () != trace_pid )
+        return;
+
+    /* A metadata event keeps the array valid JSON after the last comma */
+    len = snprintf (buf, sizeof (buf),
+        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"xinit\"}}\n]\n",
+        (int) trace_pid);
+    emit (buf, len);
+
+    close (trace_fd);
+    trace_fd = -1;
+}
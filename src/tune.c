@@ -0,0 +1,646 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#define _GNU_SOURCE  /* sched_setaffinity, cpu_set_t, SCHED_BATCH, SCHED_IDLE */
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/resource.h>  /* setpriority */
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>  /* major, minor */
+
+#include "util.h"
+#include "devices.h"
+#include "tune.h"
+
+
+#define NODE_ONLINE   "/sys/devices/system/node/online"
+#define NODE_CPUS     "/sys/devices/system/node/node%d/cpulist"
+#define CARD_NODE     "/sys/dev/char/%u:%u/device/numa_node"
+
+/* From <linux/mempolicy.h>, libnuma is not worth a dependency */
+#define MPOL_PREFERRED   1
+#define MPOL_BIND        2
+#define MPOL_INTERLEAVE  3
+
+#define OOM_ADJ       "/proc/%d/oom_score_adj"
+
+/* From <linux/ioprio.h> */
+#define IOPRIO_WHO_PROCESS  1
+#define IOPRIO_CLASS_SHIFT  13
+
+#define MASK_BITS     (8 * (int) sizeof (unsigned long))
+#define CPU_LONGS     (CPU_SETSIZE / MASK_BITS)
+#define NODE_LONGS    (1024 / MASK_BITS)
+
+#define TUNE_OFF   0
+#define TUNE_AUTO  1
+#define TUNE_LIST  2
+
+
+/*
+ * CPU affinity, NUMA memory policy, scheduling, I/O priority and OOM score
+ * of the server and the client tree, see 'server-cpus', 'server-numa',
+ * 'server-sched', 'server-ioprio' and 'server-oom-score'. All
+ * are set up in the parent and applied in the child before exec, the
+ * exec'd program and whatever it starts inherit them. "auto" means the
+ * node of the DRM card the server drives: its CPUs, its memory.
+ *
+ * 'server-boost' runs the server with another policy from fork until it
+ * is ready, tune_settle () then moves each of its threads to the steady
+ * one.
+ */
+typedef struct {
+    int set;
+    int policy;                             /* SCHED_* */
+    int value;                              /* nice, or the real-time priority */
+} Sched;
+
+typedef struct {
+    int cpus;                               /* TUNE_* */
+    unsigned long cpu_mask [CPU_LONGS];
+    int numa;                               /* TUNE_* */
+    int policy;                             /* MPOL_* */
+    unsigned long node_mask [NODE_LONGS];
+
+    /* What the child applies */
+    int set_cpus;
+    cpu_set_t cpu_set;
+    int set_numa;
+
+    Sched steady;
+    Sched boost;
+
+    int ioprio;                             /* class << 13 | level, 0 for none */
+    int set_oom;
+    char oom [8];                           /* oom_score_adj as written */
+} Tune;
+
+static const struct {
+    const char *name;
+    int policy;
+} policies [] = {
+    { "preferred",  MPOL_PREFERRED },
+    { "bind",       MPOL_BIND },
+    { "interleave", MPOL_INTERLEAVE }
+};
+
+static const struct {
+    const char *name;
+    int policy;
+} schedulers [] = {
+    { "other", SCHED_OTHER },
+    { "batch", SCHED_BATCH },
+    { "idle",  SCHED_IDLE },
+    { "fifo",  SCHED_FIFO },
+    { "rr",    SCHED_RR }
+};
+
+/* By their IOPRIO_CLASS_* */
+static const char * const io_classes [] = { "none", "realtime", "best-effort", "idle" };
+
+static const char * const tree_names [] = { "server", "client" };
+
+/* The server runs at nice -1 as xinit has always done */
+static Tune tunes [2] = { { .steady = { True, SCHED_OTHER, -1 } } };
+
+
+/*
+ * Code
+ */
+
+static int
+read_file (const char *path, char *buf, int size)
+{
+    ssize_t count;
+    int fd;
+
+    fd = open (path, O_RDONLY | O_CLOEXEC);
+    if ( fd == -1 )
+        return False;
+
+    count = read (fd, buf, size - 1);
+    close (fd);
+    if ( count < 0 )
+        return False;
+
+    buf [count] = '\0';
+    return True;
+}
+
+/* A kernel list, "0-3,8,10-11", into a bit mask of 'bits' bits */
+static int
+parse_list (const char *list, unsigned long *mask, int bits)
+{
+    const char *p = list;
+    char *end;
+    long first, last;
+
+    memset (mask, 0, bits / 8);
+    while ( *p != '\0' && *p != '\n' ) {
+        first = strtol (p, &end, 10);
+        if ( end == p || first < 0 )
+            return False;
+
+        last = first;
+        if ( *end == '-' ) {
+            p = end + 1;
+            last = strtol (p, &end, 10);
+            if ( end == p || last < first )
+                return False;
+        }
+        if ( last >= bits )
+            return False;
+
+        for ( ; first <= last; first++ )
+            mask [first / MASK_BITS] |= 1UL << (first % MASK_BITS);
+
+        p = end;
+        if ( *p == ',' && p [1] != '\0' )
+            p++;
+        else if ( *p != '\0' && *p != '\n' )
+            return False;
+    }
+    return p != list;
+}
+
+static int
+mask_bit (const unsigned long *mask, int bit)
+{
+    return (mask [bit / MASK_BITS] >> (bit % MASK_BITS)) & 1;
+}
+
+/* And back, for debug output */
+static void
+format_list (const unsigned long *mask, int bits, char *buf, int size)
+{
+    int bit, first, len = 0;
+
+    buf [0] = '\0';
+    for ( bit = 0; bit < bits && len < size - 24; bit++ ) {
+        if ( !mask_bit (mask, bit) )
+            continue;
+
+        for ( first = bit; bit + 1 < bits && mask_bit (mask, bit + 1); bit++ )
+            ;  /* NOP */
+
+        if ( bit == first )
+            len += snprintf (buf + len, size - len, len ? ",%d" : "%d", first);
+        else
+            len += snprintf (buf + len, size - len, len ? ",%d-%d" : "%d-%d", first, bit);
+    }
+}
+
+static int
+tree_of (const char *key)
+{
+    return strncmp (key, "server-", 7) == 0 ? TuneServer : TuneClient;
+}
+
+/* 'server-cpus', 'client-cpus': "no", "auto" or a CPU list */
+int
+tune_cpus (const char *key, const char *value)
+{
+    Tune *tune = tunes + tree_of (key);
+
+    if ( strcmp (value, "no") == 0 )
+        tune->cpus = TUNE_OFF;
+    else if ( strcmp (value, "auto") == 0 )
+        tune->cpus = TUNE_AUTO;
+    else if ( parse_list (value, tune->cpu_mask, CPU_SETSIZE) )
+        tune->cpus = TUNE_LIST;
+    else
+        return False;
+
+    return True;
+}
+
+/* 'server-numa', 'client-numa': "no", "auto" (preferred on the card's
+ * node) or a policy with an optional node list, "bind:0", "interleave" */
+int
+tune_numa (const char *key, const char *value)
+{
+    Tune *tune = tunes + tree_of (key);
+    const char *nodes;
+    int idx, len;
+
+    if ( strcmp (value, "no") == 0 ) {
+        tune->numa = TUNE_OFF;
+        return True;
+    }
+
+    if ( strcmp (value, "auto") == 0 ) {
+        tune->numa = TUNE_AUTO;
+        tune->policy = MPOL_PREFERRED;
+        return True;
+    }
+
+    nodes = strchr (value, ':');
+    len = nodes != NULL ? nodes - value : (int) strlen (value);
+    for ( idx = 0; idx < (int) countof (policies); idx++ ) {
+        if ( (int) strlen (policies [idx].name) == len && strncmp (value, policies [idx].name, len) == 0 )
+            break;
+    }
+    if ( idx == (int) countof (policies) )
+        return False;
+
+    tune->policy = policies [idx].policy;
+    if ( nodes == NULL )
+        tune->numa = TUNE_AUTO;
+    else if ( parse_list (nodes + 1, tune->node_mask, NODE_LONGS * MASK_BITS) )
+        tune->numa = TUNE_LIST;
+    else
+        return False;
+
+    return True;
+}
+
+static int
+real_time (int policy)
+{
+    return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static const char *
+sched_name (int policy)
+{
+    int idx;
+
+    for ( idx = 0; schedulers [idx].policy != policy; idx++ )
+        ;  /* NOP */
+
+    return schedulers [idx].name;
+}
+
+/* 'server-sched', 'server-boost', 'client-sched': "no" or a policy and
+ * its nice value or real-time priority, "other:-1", "fifo:10", "idle" */
+int
+tune_sched (const char *key, const char *value)
+{
+    Tune *tune = tunes + tree_of (key);
+    Sched *sched = strstr (key, "-boost") != NULL ? &tune->boost : &tune->steady;
+    const char *arg;
+    char *end;
+    int idx, len;
+
+    if ( strcmp (value, "no") == 0 ) {
+        sched->set = False;
+        return True;
+    }
+
+    arg = strchr (value, ':');
+    len = arg != NULL ? arg - value : (int) strlen (value);
+    for ( idx = 0; idx < (int) countof (schedulers); idx++ ) {
+        if ( (int) strlen (schedulers [idx].name) == len && strncmp (value, schedulers [idx].name, len) == 0 )
+            break;
+    }
+    if ( idx == (int) countof (schedulers) )
+        return False;
+
+    sched->policy = schedulers [idx].policy;
+    sched->value = 0;
+    if ( arg != NULL ) {
+        sched->value = strtol (arg + 1, &end, 10);
+        if ( end == arg + 1 || *end != '\0' )
+            return False;
+    }
+
+    if ( real_time (sched->policy) ) {
+        if ( sched->value < sched_get_priority_min (sched->policy) ||
+             sched->value > sched_get_priority_max (sched->policy) )
+            return False;
+    } else if ( sched->value < -20 || sched->value > 19 )
+        return False;
+
+    sched->set = True;
+    return True;
+}
+
+/* 'server-ioprio', 'client-ioprio': "no" or a class and its level,
+ * "realtime:0", "best-effort:4", "idle". The client only ever runs with
+ * the user's rights, which the realtime class takes more than */
+int
+tune_ioprio (const char *key, const char *value)
+{
+    Tune *tune = tunes + tree_of (key);
+    const char *arg;
+    char *end;
+    int cls, len, level = 4;
+
+    if ( strcmp (value, "no") == 0 ) {
+        tune->ioprio = 0;
+        return True;
+    }
+
+    arg = strchr (value, ':');
+    len = arg != NULL ? arg - value : (int) strlen (value);
+    for ( cls = 1; cls < (int) countof (io_classes); cls++ ) {
+        if ( (int) strlen (io_classes [cls]) == len && strncmp (value, io_classes [cls], len) == 0 )
+            break;
+    }
+    if ( cls == (int) countof (io_classes) || (cls == 1 && tree_of (key) == TuneClient) )
+        return False;
+
+    if ( arg != NULL ) {
+        level = strtol (arg + 1, &end, 10);
+        if ( end == arg + 1 || *end != '\0' || level < 0 || level > 7 )
+            return False;
+    }
+
+    tune->ioprio = cls << IOPRIO_CLASS_SHIFT | level;
+    return True;
+}
+
+/* 'server-oom-score', 'client-oom-score': "no" or an oom_score_adj,
+ * -1000 keeps the OOM killer away, 1000 makes it the first victim. The
+ * client runs with the user's rights and can't go below 0 */
+int
+tune_oom (const char *key, const char *value)
+{
+    Tune *tune = tunes + tree_of (key);
+    char *end;
+    long adj;
+
+    if ( strcmp (value, "no") == 0 ) {
+        tune->set_oom = False;
+        return True;
+    }
+
+    adj = strtol (value, &end, 10);
+    if ( end == value || *end != '\0' || adj < -1000 || adj > 1000 )
+        return False;
+
+    if ( adj < 0 && tree_of (key) == TuneClient )
+        return False;
+
+    /* Formatted here, the child may not use stdio */
+    snprintf (tune->oom, sizeof (tune->oom), "%ld", adj);
+    tune->set_oom = True;
+    return True;
+}
+
+/* The node of the DRM card we drive: the first one left in the inventory,
+ * which is the seat's own in multi-seat mode. -1 when there is no telling */
+static int
+card_node (void)
+{
+    char path [64], buf [16];
+    Device *dev;
+    int count;
+
+    if ( !devices_scan () )
+        return -1;
+
+    dev = devices_class (DevDrm, &count);
+    if ( count == 0 ) {
+        debugx ("tune: no DRM card to take the NUMA node from");
+        return -1;
+    }
+
+    snprintf (path, sizeof (path), CARD_NODE, major (dev->rdev), minor (dev->rdev));
+    if ( !read_file (path, buf, sizeof (buf)) )
+        return -1;
+
+    debugx ("tune: card%d is on NUMA node %s", dev->index, buf);
+    return atoi (buf);
+}
+
+static void
+resolve (int tree, int node)
+{
+    Tune *tune = tunes + tree;
+    unsigned long mask [CPU_LONGS], online [NODE_LONGS];
+    char path [64], buf [4096];
+    cpu_set_t allowed;
+    int cpu, idx, count = 0;
+
+    tune->set_cpus = False;
+    tune->set_numa = False;
+
+    if ( tune->cpus == TUNE_LIST )
+        memcpy (mask, tune->cpu_mask, sizeof (mask));
+    else if ( tune->cpus == TUNE_AUTO && node >= 0 ) {
+        snprintf (path, sizeof (path), NODE_CPUS, node);
+        if ( !read_file (path, buf, sizeof (buf)) || !parse_list (buf, mask, CPU_SETSIZE) ) {
+            debugx ("tune: no CPU list for NUMA node %d", node);
+            memset (mask, 0, sizeof (mask));
+        }
+    } else
+        memset (mask, 0, sizeof (mask));
+
+    /* Only CPUs we may run on ourselves, sched_setaffinity () would fail */
+    CPU_ZERO (&tune->cpu_set);
+    if ( sched_getaffinity (0, sizeof (allowed), &allowed) == -1 )
+        CPU_ZERO (&allowed);
+    for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+        if ( mask_bit (mask, cpu) && CPU_ISSET (cpu, &allowed) ) {
+            CPU_SET (cpu, &tune->cpu_set);
+            count++;
+        }
+    }
+
+    if ( count != 0 ) {
+        tune->set_cpus = True;
+        memset (mask, 0, sizeof (mask));
+        for ( cpu = 0; cpu < CPU_SETSIZE; cpu++ ) {
+            if ( CPU_ISSET (cpu, &tune->cpu_set) )
+                mask [cpu / MASK_BITS] |= 1UL << (cpu % MASK_BITS);
+        }
+        format_list (mask, CPU_SETSIZE, buf, 256);
+        debugx ("tune: %s on CPUs %s", tree_names [tree], buf);
+    } else if ( tune->cpus == TUNE_LIST )
+        errorx ("none of the %s CPUs are usable, affinity left alone", tree_names [tree]);
+
+    if ( tune->numa == TUNE_AUTO ) {
+        memset (tune->node_mask, 0, sizeof (tune->node_mask));
+        if ( node < 0 || node >= NODE_LONGS * MASK_BITS )
+            return;
+        tune->node_mask [node / MASK_BITS] |= 1UL << (node % MASK_BITS);
+    } else if ( tune->numa != TUNE_LIST )
+        return;
+
+    /* set_mempolicy () wants online nodes only */
+    if ( !read_file (NODE_ONLINE, buf, sizeof (buf)) || !parse_list (buf, online, NODE_LONGS * MASK_BITS) ) {
+        debugx ("tune: no NUMA support, memory policy left alone");
+        return;
+    }
+    for ( idx = 0; idx < NODE_LONGS; idx++ ) {
+        if ( tune->node_mask [idx] & ~online [idx] ) {
+            errorx ("%s NUMA nodes are not all online, memory policy left alone", tree_names [tree]);
+            return;
+        }
+    }
+
+    tune->set_numa = True;
+    format_list (tune->node_mask, NODE_LONGS * MASK_BITS, buf, 256);
+    for ( idx = 0; policies [idx].policy != tune->policy; idx++ )
+        ;  /* NOP */
+    debugx ("tune: %s memory %s on node %s", tree_names [tree], policies [idx].name, buf);
+}
+
+/*
+ * Resolve both trees once, before the first child: the card's node is
+ * only looked up when "auto" asks for it.
+ */
+void
+tune_prepare (void)
+{
+    Tune *server = tunes + TuneServer, *client = tunes + TuneClient;
+    int node = -1;
+
+    if ( server->cpus == TUNE_AUTO || server->numa == TUNE_AUTO ||
+         client->cpus == TUNE_AUTO || client->numa == TUNE_AUTO )
+        node = card_node ();
+
+    resolve (TuneServer, node);
+    resolve (TuneClient, node);
+
+    if ( server->boost.set )
+        debugx ("tune: server boosted to %s:%d until ready", sched_name (server->boost.policy), server->boost.value);
+    if ( server->steady.set )
+        debugx ("tune: server runs %s:%d", sched_name (server->steady.policy), server->steady.value);
+    if ( client->steady.set )
+        debugx ("tune: client runs %s:%d", sched_name (client->steady.policy), client->steady.value);
+}
+
+/* Also from the parent, for any thread: async-signal-safe */
+static int
+apply_sched (pid_t tid, const Sched *sched)
+{
+    struct sched_param param;
+
+    param.sched_priority = real_time (sched->policy) ? sched->value : 0;
+    if ( sched_setscheduler (tid, sched->policy, &param) == -1 )
+        return False;
+
+    return real_time (sched->policy) || setpriority (PRIO_PROCESS, tid, sched->value) == 0;
+}
+
+/* In the child before exec: async-signal-safe, failures are not fatal */
+void
+tune_child (TuneTree tree)
+{
+    Tune *tune = tunes + tree;
+    ssize_t unused;
+    int fd;
+
+    if ( tune->set_cpus )
+        sched_setaffinity (0, sizeof (tune->cpu_set), &tune->cpu_set);
+
+    if ( tune->set_numa )
+        syscall (SYS_set_mempolicy, tune->policy, tune->node_mask, NODE_LONGS * MASK_BITS + 1);
+
+    if ( tune->boost.set )
+        apply_sched (0, &tune->boost);
+    else if ( tune->steady.set )
+        apply_sched (0, &tune->steady);
+
+    if ( tune->ioprio != 0 )
+        syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, tune->ioprio);
+
+    /* Not being let lower is reported by tune_report () */
+    if ( tune->set_oom ) {
+        fd = open ("/proc/self/oom_score_adj", O_WRONLY | O_CLOEXEC);
+        if ( fd != -1 ) {
+            unused = write (fd, tune->oom, strlen (tune->oom));
+            (void) unused;
+            close (fd);
+        }
+    }
+}
+
+/*
+ * What the child ended up with once it has been exec'd: lowering the OOM
+ * score and the realtime I/O class take privileges the server may not
+ * have had, the client never has them.
+ */
+void
+tune_report (TuneTree tree, pid_t pid)
+{
+    Tune *tune = tunes + tree;
+    char path [64], adj [16];
+    int ioprio;
+
+    if ( tune->ioprio == 0 && !tune->set_oom )
+        return;
+
+    ioprio = syscall (SYS_ioprio_get, IOPRIO_WHO_PROCESS, pid);
+    snprintf (path, sizeof (path), OOM_ADJ, (int) pid);
+    if ( !read_file (path, adj, sizeof (adj)) )
+        snprintf (adj, sizeof (adj), "?");
+    adj [strcspn (adj, "\n")] = '\0';
+
+    if ( ioprio == -1 )
+        debug ("tune: %s I/O priority unknown, oom_score_adj %s", tree_names [tree], adj);
+    else
+        debugx ("tune: %s I/O priority %s:%d, oom_score_adj %s", tree_names [tree],
+            io_classes [(ioprio >> IOPRIO_CLASS_SHIFT) & 3], ioprio & 7, adj);
+
+    if ( tune->ioprio != 0 && ioprio != tune->ioprio )
+        errorx ("unable to set the %s I/O priority", tree_names [tree]);
+    if ( tune->set_oom && strcmp (adj, tune->oom) != 0 )
+        errorx ("unable to set the %s oom_score_adj to %s", tree_names [tree], tune->oom);
+}
+
+/*
+ * The boosted server is ready: every thread it has started meanwhile
+ * inherited the boost, all of them go to the steady policy, or back to
+ * the default one without 'server-sched'.
+ */
+void
+tune_settle (TuneTree tree, pid_t pid)
+{
+    static const Sched fallback = { True, SCHED_OTHER, 0 };
+    Tune *tune = tunes + tree;
+    const Sched *sched = tune->steady.set ? &tune->steady : &fallback;
+    char path [64];
+    struct dirent *entry;
+    int count = 0, failed = 0;
+    DIR *dir;
+
+    if ( !tune->boost.set )
+        return;
+
+    snprintf (path, sizeof (path), "/proc/%d/task", (int) pid);
+    dir = opendir (path);
+    if ( dir == NULL ) {
+        debug ("unable to list the threads of %d", (int) pid);
+        return;
+    }
+
+    while ( (entry = readdir (dir)) != NULL ) {
+        if ( entry->d_name [0] == '.' )
+            continue;
+
+        if ( apply_sched (atoi (entry->d_name), sched) )
+            count++;
+        else
+            failed++;
+    }
+    closedir (dir);
+
+    debugx ("tune: %s settled on %s:%d, %d threads, %d failed", tree_names [tree],
+        sched_name (sched->policy), sched->value, count, failed);
+}
@@ -0,0 +1,41 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _TUNE_H
+#define _TUNE_H
+
+#include <sys/types.h>
+
+
+typedef enum {
+    TuneServer,
+    TuneClient
+} TuneTree;
+
+
+int tune_cpus (const char *key, const char *value);
+int tune_numa (const char *key, const char *value);
+int tune_sched (const char *key, const char *value);
+int tune_ioprio (const char *key, const char *value);
+int tune_oom (const char *key, const char *value);
+void tune_prepare (void);
+void tune_child (TuneTree tree);
+void tune_settle (TuneTree tree, pid_t pid);
+void tune_report (TuneTree tree, pid_t pid);
+
+
+#endif  /* _TUNE_H */
@@ -33,38 +33,42 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <pwd.h>  /* getpwnam */
-#include <grp.h>  /* getgrouplist */
+#include <limits.h>  /* INT_MAX */
+#include <time.h>  /* clock_gettime */
+#include <pthread.h>
 #include <drm.h>  /* DRM_IOCTL_SET_MASTER */
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <linux/vt.h>  /* VT_GETSTATE */
 
 #include "util.h"
-
-
-#define CONFIG_FILE      "/etc/X11/xinit/config"
+#include "devices.h"
+#include "cache.h"
+#include "ident.h"
+#include "prefetch.h"
+#include "restart.h"
+#include "tune.h"
+#include "seat.h"
+#include "vt.h"
+
+
+#ifndef CONFIG_FILE
+# define CONFIG_FILE     "/etc/X11/xinit/config"  /* make bench points it elsewhere */
+#endif
 #define SESSION_WRAPPER  "/etc/X11/Xsession"
 #define SERVER           "/usr/bin/X"
-
-/* Helper macros: sizeof ("abc") = strlen ("abc") + 1 */
-#define EVENT_DEV_NAME    "/dev/input/event%d"
-#define EVENT_DEV_LENGTH  (sizeof (EVENT_DEV_NAME))
-        
-#define FB_DEV_NAME       "/dev/fb%d"
-#define FB_DEV_LENGTH     (sizeof (FB_DEV_NAME))
-
-#define TTY_DEV_NAME      "/dev/tty%d"
-#define TTY_DEV_LENGTH    (sizeof (TTY_DEV_NAME))  /* tty is between 0 and 64 */
-
-#define VC_DEV_NAME       "/dev/vc/%d"
-#define VC_DEV_LENGTH     (sizeof (VC_DEV_NAME))  /* vc is between 0 and 64 */
-
-#define DISPLAY_PATH      "/tmp/.X11-unix/X%d"
-#define DISPLAY_LENGTH    (sizeof (DISPLAY_PATH))  /* display is between 0 and 99 */
-
-#define DRM_DEV_NAME      "/dev/dri/card%d"
-#define DRM_DEV_LENGTH    (sizeof (DRM_DEV_NAME))  /* idx is between 0 and 16 */
+#define SERVER_TIMEOUT   120000  /* ms */
+#define TERM_GRACE       10000   /* ms */
+#define KILL_GRACE       3000    /* ms */
+#define NSS_TIMEOUT      2000    /* ms */
+#define RESTART_BACKOFF  500     /* ms */
+#define OUTPUT_SIZE      1048576
+#define OUTPUT_KEEP      3
+#define SAMPLE_INTERVAL  1000    /* ms */
+#define WATCHDOG_STALL   10000   /* ms */
+
+/* Device probes of check_rights () run in parallel, one thread each */
+#define PROBE_COUNT       3
 
 /* KISS non locale / LANG parsing isspace version */
 #define IS_SPACE(c)       ((c) == ' ' || (c) == '\t' || (c) == '\n')
@@ -76,11 +80,28 @@ typedef enum {
    Anybody
 } Allowed;
 
+typedef struct _Probe Probe;
+
+struct _Probe {
+    const char *name;
+    int (*func) (Probe *probe);
+    uid_t uid;
+    gid_t *grouplist;
+    int ngroups;
+    int shareVTs;
+    Device *chmod;      /* tty to open up once all probes passed */
+    int cacheable;      /* the result only depends on the cache key */
+    int result;         /* True, False or DIE */
+    long long time;     /* us */
+    pthread_t thread;
+};
+
 typedef enum {
     FlagDropRoot     = (1 << 0),
     FlagDropRootAuto = (1 << 1),
     FlagDebug        = (1 << 2),
-    FlagAllowChmod   = (1 << 3)
+    FlagAllowChmod   = (1 << 3),
+    FlagRightsCache  = (1 << 4)
 } Flags;
 
 
@@ -94,13 +115,41 @@ static const char *no_name = "no";        /* False */
 static const char *false_name = "false";  /* False */
 static const char *auto_name = "auto";    /* SCHROEDINGER_CAT */
 
-static Flags u_flags = FlagAllowChmod | FlagDropRootAuto;
+static Flags u_flags = FlagAllowChmod | FlagDropRootAuto | FlagRightsCache;
 static Allowed allowed = ConsoleOnly;
 
 const char *prog_name;
 char *u_session = NULL;
 char *u_display = NULL;
 char *u_server = NULL;
+int u_server_timeout = SERVER_TIMEOUT;
+int u_displayfd = True;
+int u_listenfd = True;
+int u_reserve_vt = True;
+int u_term_grace = TERM_GRACE;
+int u_kill_grace = KILL_GRACE;
+int u_nss_timeout = NSS_TIMEOUT;
+char *u_trace_file = NULL;
+int u_early_client = False;
+int u_prefetch = True;
+int u_pool_size = 0;
+int u_pool_recycle = 1;
+char *u_pool_screen = NULL;
+char *u_pool_socket = NULL;
+int u_restart_max = 0;
+int u_restart_backoff = RESTART_BACKOFF;
+char *u_cgroup = NULL;
+char *u_server_cgroup = NULL;
+char *u_client_cgroup = NULL;
+char *u_server_output = NULL;
+char *u_client_output = NULL;
+int u_output_size = OUTPUT_SIZE;
+int u_output_keep = OUTPUT_KEEP;
+char *u_metrics = NULL;
+char *u_sample_file = NULL;
+int u_sample_interval = SAMPLE_INTERVAL;
+int u_watchdog_interval = 0;
+int u_watchdog_stall = WATCHDOG_STALL;
 
 
 /*
@@ -234,32 +283,22 @@ set_server (const char *value)
     return u_server != NULL;
 }
 
-static char *
-s_display (int num)
+long long
+mono_ms (void)
 {
-    char *s_disp;
-
-    s_disp = x_malloc (sizeof (char) >> 2);  /* ":nn\0" */
-    if ( s_disp == NULL )
-        return NULL;
+    struct timespec ts;
 
-    snprintf (s_disp, sizeof (char) >> 2, ":%d", num);
-    return s_disp;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static char *
-find_free_display (void)
+long long
+mono_us (void)
 {
-    char path [DISPLAY_LENGTH];
-    int idx;
-    struct stat st;
+    struct timespec ts;
 
-    for ( idx = 0; idx < 100; idx++ ) {
-        snprintf (path, DISPLAY_LENGTH, DISPLAY_PATH, idx);
-        if ( stat (path, &st) != 0 )
-            return s_display (idx);
-    }
-    return NULL;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 void
@@ -268,6 +307,20 @@ free_util (void)
     free (u_session);
     free (u_display);
     free (u_server);
+    free (u_trace_file);
+    free (u_pool_screen);
+    free (u_pool_socket);
+    free (u_cgroup);
+    free (u_server_cgroup);
+    free (u_client_cgroup);
+    free (u_server_output);
+    free (u_client_output);
+    free (u_metrics);
+    free (u_sample_file);
+    devices_free ();
+    ident_free ();
+    prefetch_free ();
+    seat_free ();
 }
 
 static void
@@ -292,8 +345,10 @@ debug (const char *fmt, ...)
         return;
 
     va_start(ap, fmt);
+    flockfile (stderr);  /* probes print from several threads */
     err_begin (fmt, ap);
     err_end ();
+    funlockfile (stderr);
     va_end(ap);
 }
 
@@ -306,8 +361,10 @@ debugx (const char *fmt, ...)
         return;
 
     va_start(ap, fmt);
+    flockfile (stderr);
     err_begin (fmt, ap);
     fputc ( '\n', stderr);
+    funlockfile (stderr);
     va_end(ap);
 }
 
@@ -364,16 +421,29 @@ parse_int (const char *value)
     return SCHROEDINGER_CAT;
 }
 
+static int
+parse_number (const char *value, int *result)
+{
+    char *end;
+    long val;
+
+    errno = 0;
+    val = strtol (value, &end, 10);
+    if ( errno != 0 || end == value || *end != '\0' || val < 0 || val > INT_MAX )
+        return False;
+
+    *result = (int) val;
+    return True;
+}
+
 int
 parse_config (void)
 {
     FILE *config;
     char buf [1024];
-    char *temp, *key, *val_s;
+    char *temp, *key, *val_s, **output;
     int val_i, line = 0;
 
-    find_free_display ();
-
     config = fopen (CONFIG_FILE, "r");
     if ( config == NULL ) {
         debugx ("could not open config file %s, using default values:\n allowed=%s\n drop-root=%s\n allow-chmod=%s\n session-wrapper=%s\n u_display=%s\n u_server=%s",
@@ -460,6 +530,17 @@ parse_config (void)
             if ( val_i )
                 u_flags |= FlagDebug;
         }
+        else if (strcmp(key, "rights-cache") == 0) {
+            u_flags &= ~FlagRightsCache;
+
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'rights-cache' at line %d", val_s, line);
+                goto quit;
+            }
+            if ( val_i )
+                u_flags |= FlagRightsCache;
+        }
         else if (strcmp(key, "allow-chmod") == 0) {
             u_flags &= ~FlagAllowChmod;
 
@@ -471,6 +552,241 @@ parse_config (void)
             if ( val_i )
                 u_flags |= FlagAllowChmod;
         }
+        else if (strcmp(key, "displayfd") == 0) {
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'displayfd' at line %d", val_s, line);
+                goto quit;
+            }
+            u_displayfd = val_i;
+        }
+        else if (strcmp(key, "listenfd") == 0) {
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'listenfd' at line %d", val_s, line);
+                goto quit;
+            }
+            u_listenfd = val_i;
+        }
+        else if (strcmp(key, "reserve-vt") == 0) {
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'reserve-vt' at line %d", val_s, line);
+                goto quit;
+            }
+            u_reserve_vt = val_i;
+        }
+        else if (strcmp(key, "seat") == 0) {
+            if ( !seat_add (val_s) )
+                goto quit;
+        }
+        else if (strcmp(key, "prefetch") == 0) {
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'prefetch' at line %d", val_s, line);
+                goto quit;
+            }
+            u_prefetch = val_i;
+        }
+        else if (strcmp(key, "early-client") == 0) {
+            val_i = parse_int (val_s);
+            if ( val_i == SCHROEDINGER_CAT ) {
+                errorx ("invalid value '%s' for 'early-client' at line %d", val_s, line);
+                goto quit;
+            }
+            u_early_client = val_i;
+        }
+        else if (strcmp(key, "server-timeout") == 0) {
+            if ( !parse_number (val_s, &u_server_timeout) ) {
+                errorx ("invalid value '%s' for 'server-timeout' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "term-grace") == 0) {
+            if ( !parse_number (val_s, &u_term_grace) ) {
+                errorx ("invalid value '%s' for 'term-grace' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "kill-grace") == 0) {
+            if ( !parse_number (val_s, &u_kill_grace) ) {
+                errorx ("invalid value '%s' for 'kill-grace' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "nss-timeout") == 0) {
+            if ( !parse_number (val_s, &u_nss_timeout) ) {
+                errorx ("invalid value '%s' for 'nss-timeout' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "cgroup") == 0) {
+            free (u_cgroup);
+            u_cgroup = NULL;
+
+            /* "no", "auto" or a path below /sys/fs/cgroup */
+            if ( parse_int (val_s) != False ) {
+                if ( *val_s != '/' && strcmp (val_s, "auto") != 0 ) {
+                    errorx ("invalid value '%s' for 'cgroup' at line %d", val_s, line);
+                    goto quit;
+                }
+                u_cgroup = s_dup (val_s);
+                if ( u_cgroup == NULL )
+                    goto quit;
+            }
+        }
+        else if (strcmp(key, "server-cgroup") == 0) {
+            free (u_server_cgroup);
+            u_server_cgroup = s_dup (val_s);
+            if ( u_server_cgroup == NULL )
+                goto quit;
+        }
+        else if (strcmp(key, "client-cgroup") == 0) {
+            free (u_client_cgroup);
+            u_client_cgroup = s_dup (val_s);
+            if ( u_client_cgroup == NULL )
+                goto quit;
+        }
+        else if (strcmp(key, "server-cpus") == 0 || strcmp(key, "client-cpus") == 0) {
+            if ( !tune_cpus (key, val_s) ) {
+                errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "server-numa") == 0 || strcmp(key, "client-numa") == 0) {
+            if ( !tune_numa (key, val_s) ) {
+                errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "server-sched") == 0 || strcmp(key, "server-boost") == 0 ||
+                 strcmp(key, "client-sched") == 0) {
+            if ( !tune_sched (key, val_s) ) {
+                errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "server-ioprio") == 0 || strcmp(key, "client-ioprio") == 0) {
+            if ( !tune_ioprio (key, val_s) ) {
+                errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "server-oom-score") == 0 || strcmp(key, "client-oom-score") == 0) {
+            if ( !tune_oom (key, val_s) ) {
+                errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "server-output") == 0 || strcmp(key, "client-output") == 0) {
+            output = *key == 's' ? &u_server_output : &u_client_output;
+            free (*output);
+            *output = NULL;
+
+            /* "inherit", "ring" or a log file */
+            if ( strcmp (val_s, "inherit") != 0 ) {
+                if ( *val_s != '/' && strcmp (val_s, "ring") != 0 ) {
+                    errorx ("invalid value '%s' for '%s' at line %d", val_s, key, line);
+                    goto quit;
+                }
+                *output = s_dup (val_s);
+                if ( *output == NULL )
+                    goto quit;
+            }
+        }
+        else if (strcmp(key, "output-size") == 0) {
+            if ( !parse_number (val_s, &u_output_size) || u_output_size < 4096 ) {
+                errorx ("invalid value '%s' for 'output-size' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "output-keep") == 0) {
+            if ( !parse_number (val_s, &u_output_keep) ) {
+                errorx ("invalid value '%s' for 'output-keep' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "metrics") == 0) {
+            free (u_metrics);
+            u_metrics = NULL;
+
+            /* "no", "auto" or a socket path */
+            if ( parse_int (val_s) != False ) {
+                if ( *val_s != '/' && strcmp (val_s, "auto") != 0 ) {
+                    errorx ("invalid value '%s' for 'metrics' at line %d", val_s, line);
+                    goto quit;
+                }
+                u_metrics = s_dup (val_s);
+                if ( u_metrics == NULL )
+                    goto quit;
+            }
+        }
+        else if (strcmp(key, "sample-file") == 0) {
+            free (u_sample_file);
+            u_sample_file = s_dup (val_s);
+            if ( u_sample_file == NULL )
+                goto quit;
+        }
+        else if (strcmp(key, "sample-interval") == 0) {
+            if ( !parse_number (val_s, &u_sample_interval) || u_sample_interval < 10 ) {
+                errorx ("invalid value '%s' for 'sample-interval' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "watchdog-interval") == 0) {
+            if ( !parse_number (val_s, &u_watchdog_interval) ) {
+                errorx ("invalid value '%s' for 'watchdog-interval' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "watchdog-stall") == 0) {
+            if ( !parse_number (val_s, &u_watchdog_stall) || u_watchdog_stall == 0 ) {
+                errorx ("invalid value '%s' for 'watchdog-stall' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "restart-max") == 0) {
+            if ( !parse_number (val_s, &u_restart_max) || u_restart_max > RESTART_MAX ) {
+                errorx ("invalid value '%s' for 'restart-max' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "restart-backoff") == 0) {
+            if ( !parse_number (val_s, &u_restart_backoff) ) {
+                errorx ("invalid value '%s' for 'restart-backoff' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "pool-size") == 0) {
+            if ( !parse_number (val_s, &u_pool_size) ) {
+                errorx ("invalid value '%s' for 'pool-size' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "pool-recycle") == 0) {
+            if ( !parse_number (val_s, &u_pool_recycle) || u_pool_recycle < 1 ) {
+                errorx ("invalid value '%s' for 'pool-recycle' at line %d", val_s, line);
+                goto quit;
+            }
+        }
+        else if (strcmp(key, "pool-screen") == 0) {
+            free (u_pool_screen);
+            u_pool_screen = s_dup (val_s);
+            if ( u_pool_screen == NULL )
+                goto quit;
+        }
+        else if (strcmp(key, "pool-socket") == 0) {
+            free (u_pool_socket);
+            u_pool_socket = s_dup (val_s);
+            if ( u_pool_socket == NULL )
+                goto quit;
+        }
+        else if (strcmp(key, "trace-file") == 0) {
+            free (u_trace_file);
+            u_trace_file = s_dup (val_s);
+            if ( u_trace_file == NULL )
+                goto quit;
+        }
         else if (strcmp (key, "session-wrapper") == 0) {
             if ( !set_session (val_s) )
                 goto quit;
@@ -502,15 +818,15 @@ quit:
 }
 
 static int
-check_user_rights (struct stat *st, uid_t uid, int read, int write)
+check_user_rights (const Device *dev, uid_t uid, int read, int write)
 {
-    if ( st->st_uid != uid )
+    if ( dev->uid != uid )
         return False;
 
-    if ( read && !(st->st_mode & S_IRUSR) )
+    if ( read && !(dev->mode & S_IRUSR) )
         return False;
 
-    if ( write && !(st->st_mode & S_IWUSR) )
+    if ( write && !(dev->mode & S_IWUSR) )
         return False;
 
     return True;
@@ -529,27 +845,27 @@ group_list_find (gid_t *grouplist, int ngroups, gid_t value)
 }
 
 static int
-check_group_rights (struct stat *st, gid_t *grouplist, int ngroups, int read, int write)
+check_group_rights (const Device *dev, gid_t *grouplist, int ngroups, int read, int write)
 {
-    if ( group_list_find (grouplist, ngroups, st->st_gid ) == -1 )
+    if ( group_list_find (grouplist, ngroups, dev->gid ) == -1 )
         return False;
 
-    if ( read && !(st->st_mode & S_IRGRP) )
+    if ( read && !(dev->mode & S_IRGRP) )
         return False;
 
-    if ( write && !(st->st_mode & S_IWGRP) )
+    if ( write && !(dev->mode & S_IWGRP) )
         return False;
 
     return True;
 }
 
 static int
-check_other_rights (struct stat *st, int read, int write)
+check_other_rights (const Device *dev, int read, int write)
 {
-    if ( read && !(st->st_mode & S_IROTH) )
+    if ( read && !(dev->mode & S_IROTH) )
         return False;
 
-    if ( write && !(st->st_mode & S_IWOTH) )
+    if ( write && !(dev->mode & S_IWOTH) )
         return False;
 
     return True;
@@ -567,76 +883,74 @@ str_vstate (char *buf, int val)
 }
 
 static int
-dev_has_rights (uid_t uid, gid_t *grouplist, int ngroups, const char *dev, int fd, int read, int write)
+dev_has_rights (uid_t uid, gid_t *grouplist, int ngroups, const Device *dev, int read, int write)
 {
-    struct stat dev_stat;
-    int result;
+    char path [DEVICE_PATH_LENGTH];
     char buf [17];
 
-    /* Get device properties */
-    if ( fd != -1 )
-        result = fstat (fd, &dev_stat);
-    else
-        result = stat (dev, &dev_stat);
+    /* Device properties come from the inventory, no syscall here */
 
-    if ( result == -1 ) {
-        debug ("could not read stats for %s", dev);
-        return DIE;
-    }
     /* Other read/write permissions */
-    if ( check_other_rights (&dev_stat, read, write) )
+    if ( check_other_rights (dev, read, write) )
         return True;
     /* User read/write permissions */
-    if ( check_user_rights (&dev_stat, uid, read, write) )
+    if ( check_user_rights (dev, uid, read, write) )
         return True;
     /* Group read/write permissions */
-    if ( check_group_rights (&dev_stat, grouplist, ngroups, read, write) )
+    if ( check_group_rights (dev, grouplist, ngroups, read, write) )
         return True;
 
-    str_vstate (buf, dev_stat.st_mode);
+    devices_path (dev, path, sizeof (path));
+    str_vstate (buf, dev->mode);
     debugx ("device %s does not have necessary permissions: owner=%d group=%d mode=%s",
-           dev, dev_stat.st_uid, dev_stat.st_gid, buf);
+           path, dev->uid, dev->gid, buf);
     return False;
 }
 
 static int
-tty_dev_chmod (int idx)
+tty_dev_chmod (Device *dev)
 {
-    struct stat tty_stat;
-    char tty_name [TTY_DEV_LENGTH]; /* max tty idx is 64 */
+    char tty_name [DEVICE_PATH_LENGTH];
     char src [17], dest [17];
+    mode_t mode;
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
-    snprintf (tty_name, TTY_DEV_LENGTH, TTY_DEV_NAME, idx);  /* /dev/tty$idx */
-#pragma GCC diagnostic pop
+    devices_path (dev, tty_name, sizeof (tty_name));  /* /dev/tty$idx */
 
-    /* We'll read stats and then we'll update 'rw' permissions for group */
-    if ( stat (tty_name, &tty_stat) == -1 ) {
-        debug ("could not read stats for %s", tty_name);
-        return DIE;
-    }
-    str_vstate (src, tty_stat.st_mode);
-    tty_stat.st_mode |= S_IRGRP | S_IWGRP;
-    str_vstate (dest, tty_stat.st_mode);
+    /* We'll update 'rw' permissions for group */
+    mode = dev->mode | S_IRGRP | S_IWGRP;
+    str_vstate (src, dev->mode);
+    str_vstate (dest, mode);
 
-    if ( chmod (tty_name, tty_stat.st_mode) == -1 ) {
+    if ( chmod (tty_name, mode) == -1 ) {
         debug ("could not change permissions for %s (%s -> %s)", tty_name, src, dest);
         return DIE;
     }
     debugx ("changed permissions for %s (%s -> %s)", tty_name, src, dest);
+
+    /* Keep the inventory in sync */
+    dev->mode = mode;
     return True;
 }
 
 static int
 tty_zero_dev_has_rights (uid_t uid, gid_t *grouplist, int ngroups, int *vstate)
 {
-    char tty_name [TTY_DEV_LENGTH]; /* max tty idx is 64 */
+    char tty_name [DEVICE_PATH_LENGTH];
     int fd, result;
     struct vt_stat vts;
     char buf[17]; /* max short (0xFFFF) has 16 bits + null char */
-    
-    snprintf (tty_name, TTY_DEV_LENGTH, TTY_DEV_NAME, 0);  /* /dev/tty$idx */
+    Device *dev;
+
+    dev = devices_find (DevTty, 0);
+    if ( dev == NULL ) {
+        debugx ("could not find /dev/tty0");
+        return DIE;
+    }
+    devices_path (dev, tty_name, sizeof (tty_name));  /* /dev/tty0 */
+
+    result = dev_has_rights (uid, grouplist, ngroups, dev, False, True);
+    if ( result != True )  /* Attn: don't change to `if (!result)` due to DIE result */
+        return result;
 
     fd = open (tty_name, O_RDONLY, 0);
     if ( fd == -1 ) { 
@@ -644,10 +958,6 @@ tty_zero_dev_has_rights (uid_t uid, gid_t *grouplist, int ngroups, int *vstate)
         return (errno == EACCES) ? False : DIE;
     }
 
-    result = dev_has_rights (uid, grouplist, ngroups, tty_name, fd, False, True);
-    if ( result != True )  /* Attn: don't change to `if (!result)` due to DIE result */
-        return result;
-
     if ( ioctl (fd, VT_GETSTATE, &vts) == -1 ) {
         debug ("%s: could not find the current VT", tty_name );
         goto quit;
@@ -673,16 +983,13 @@ quit:
 static int
 events_have_rights (uid_t uid, gid_t *grouplist, int ngroups)
 {
-    int idx, result;
-    char event_name [EVENT_DEV_LENGTH];
+    char event_name [DEVICE_PATH_LENGTH];
+    Device *dev;
+    int count;
 
-    for ( idx = 0; idx < 32; idx++ ) {
-        snprintf (event_name, EVENT_DEV_LENGTH, EVENT_DEV_NAME, idx);  /* /dev/input/event$idx */
-        result = dev_has_rights (uid, grouplist, ngroups, event_name, -1, True, False);
-        if ( result == DIE )
-            return DIE;
-
-        if ( result ) {
+    for ( dev = devices_class (DevEvent, &count); count != 0; dev++, count-- ) {
+        if ( dev_has_rights (uid, grouplist, ngroups, dev, True, False) ) {
+            devices_path (dev, event_name, sizeof (event_name));  /* /dev/input/event$idx */
             debugx ("found input device %s with necessary permissions", event_name);
             return True;
         }
@@ -692,12 +999,14 @@ events_have_rights (uid_t uid, gid_t *grouplist, int ngroups)
     return False;
 }
 
+/* A tty the user could have with 'allow-chmod' goes to *chmod and the
+ * answer is False: the caller decides whether to change it */
 static int
-ttys_have_rights (uid_t uid, gid_t *grouplist, int ngroups, int shareVTs)
+ttys_have_rights (uid_t uid, gid_t *grouplist, int ngroups, int shareVTs, Device **chmod)
 {
-    int idx, vtno, vstate, vtfree = -1;
+    int idx, vtno, vstate;
     int mask = 1 << 1;  /* The loop starts from tty1 (1 belongs to tty0) */
-    char tty_name [TTY_DEV_LENGTH]; /* max tty idx is 64 */
+    Device *dev, *vtfree = NULL;
 
     /* Is the current user in the tty group?? */
     vtno = tty_zero_dev_has_rights (uid, grouplist, ngroups, &vstate);
@@ -710,11 +1019,32 @@ ttys_have_rights (uid_t uid, gid_t *grouplist, int ngroups, int shareVTs)
     }
     /* 'sharevts' argument has been used */
     if ( shareVTs ) {
-        snprintf (tty_name, TTY_DEV_LENGTH, TTY_DEV_NAME, vtno);  /* /dev/tty$idx */
-        return dev_has_rights (uid, grouplist, ngroups, tty_name, -1, True, True);
+        dev = devices_find (DevTty, vtno);  /* /dev/tty$idx */
+        if ( dev == NULL ) {
+            debugx ("could not find /dev/tty%d", vtno);
+            return DIE;
+        }
+        return dev_has_rights (uid, grouplist, ngroups, dev, True, True);
+    }
+
+    /* The VT the server is given, see vt_claim () */
+    idx = vt_number ();
+    if ( idx != 0 ) {
+        dev = devices_find (DevTty, idx);  /* /dev/tty$idx */
+        if ( dev == NULL ) {
+            debugx ("could not find /dev/tty%d", idx);
+            return False;
+        }
+        if ( dev_has_rights (uid, grouplist, ngroups, dev, True, True) )
+            return True;
+
+        if ( u_flags & FlagAllowChmod )
+            *chmod = dev;
+        return False;
     }
 
-    /* Emulate VT_OPENQRY: find a free VT except the current one */
+    /* Without 'reserve-vt' emulate VT_OPENQRY: find a free VT except the
+     * current one */
     for ( idx = 1; idx < 16; idx++, mask <<= 1 ) {
         /* Skip when a VT is used */
 #pragma GCC diagnostic push
@@ -725,27 +1055,26 @@ ttys_have_rights (uid_t uid, gid_t *grouplist, int ngroups, int shareVTs)
         }
 #pragma GCC diagnostic pop
 
-        snprintf (tty_name, TTY_DEV_LENGTH, TTY_DEV_NAME, idx);  /* /dev/tty$idx */
-
-        vtno = dev_has_rights (uid, grouplist, ngroups, tty_name, -1, True, True);
-        if ( vtno == DIE )
-            return DIE;
+        /* No node, no VT */
+        dev = devices_find (DevTty, idx);  /* /dev/tty$idx */
+        if ( dev == NULL )
+            continue;
 
-        if ( vtno ) {
+        if ( dev_has_rights (uid, grouplist, ngroups, dev, True, True) ) {
             /* X u_server will be able to open virtual console */
             debugx ("found free VT: %d", idx);
             return True;
         }
 
-        /* Save the first free VT index */
-        if ( vtfree == -1 )
-            vtfree = idx;
+        /* Save the first free VT */
+        if ( vtfree == NULL )
+            vtfree = dev;
     }
     debugx ("could not find a free VT: check permissions");
 
     /* Let's try to change permissions when chmod is allowed */
-    if ( u_flags & FlagAllowChmod && vtfree != -1 )
-        return tty_dev_chmod (vtfree);
+    if ( u_flags & FlagAllowChmod )
+        *chmod = vtfree;
 
     return False;
 }
@@ -776,17 +1105,14 @@ is_user_allowed (gid_t uid)
 static int
 fbs_have_rights (uid_t uid, gid_t *grouplist, int ngroups)
 {
-    int idx, result;
-    char fb_name [FB_DEV_LENGTH];
+    char fb_name [DEVICE_PATH_LENGTH];
+    Device *dev;
+    int count;
 
     /* Try to find first valid framebuffer device */
-    for ( idx = 0; idx < 8; idx++ ) {
-        snprintf (fb_name, FB_DEV_LENGTH, FB_DEV_NAME, idx);  /* /dev/fb$idx */
-        result = dev_has_rights (uid, grouplist, ngroups, fb_name, -1, True, True);
-        if ( result == DIE )
-            return DIE;
-
-        if ( result ) {
+    for ( dev = devices_class (DevFb, &count); count != 0; dev++, count-- ) {
+        if ( dev_has_rights (uid, grouplist, ngroups, dev, True, True) ) {
+            devices_path (dev, fb_name, sizeof (fb_name));  /* /dev/fb$idx */
             debugx ("found valid framebuffer device: %s", fb_name);
             return True;
         }
@@ -795,56 +1121,18 @@ fbs_have_rights (uid_t uid, gid_t *grouplist, int ngroups)
     return False;
 }
 
-static void
-debug_grouplist (gid_t *grouplist, int ngroups)
-{
-    int idx;
-
-    if ( (u_flags & FlagDebug) == 0 )
-        return;
-
-    for ( idx = 0; idx < ngroups; idx++ ) {
-        fprintf (stderr, " %d", *grouplist++);
-    }
-    fputc ('\n', stderr);
-}
-
-static gid_t *
-get_user_groups (uid_t uid, int *ngroups)
-{
-    struct passwd *pwd;
-    gid_t *grouplist;
-    int count = 0;
-    
-    pwd = getpwuid (uid);
-    if ( pwd == NULL ) {
-        debug ("getpwuid error");
-        return NULL;
-    }
-
-    getgrouplist (pwd->pw_name, pwd->pw_gid, NULL, &count );
-    debugx ("user %s is a member of %d groups", pwd->pw_name, count);
-
-    grouplist = malloc (count * sizeof (gid_t));
-    if ( grouplist == NULL ) {
-        error_no_memory ();
-        return NULL;
-    }
-
-    getgrouplist (pwd->pw_name, pwd->pw_gid, grouplist, &count);
-    debug_grouplist (grouplist, count);
-    
-    *ngroups = count;
-    return grouplist;
-}
-
 static int
-drm_dev_has_rights (int idx, uid_t uid, gid_t *grouplist, int ngroups)
+drm_dev_has_rights (const Device *dev, uid_t uid, gid_t *grouplist, int ngroups)
 {
-    char drm_name [DRM_DEV_LENGTH];
+    char drm_name [DEVICE_PATH_LENGTH];
     int fd, result;
-    
-    snprintf (drm_name, DRM_DEV_LENGTH, DRM_DEV_NAME, idx);
+
+    /* Don't even open the card without the permissions */
+    result = dev_has_rights (uid, grouplist, ngroups, dev, True, True);
+    if ( result != True )
+        return result;
+
+    devices_path (dev, drm_name, sizeof (drm_name));
 
     fd = open (drm_name, O_RDONLY, 0);
     if ( fd == -1 ) {
@@ -852,10 +1140,6 @@ drm_dev_has_rights (int idx, uid_t uid, gid_t *grouplist, int ngroups)
         return False;
     }
 
-    result = dev_has_rights (uid, grouplist, ngroups, drm_name, fd, True, True);
-    if ( result != True )
-        goto quit;
-
     /* Only root can call drm_set_master and drm_drop_master in Linux kernel 4.x
      * so let's try to set drm master and don't terminate the app (DIE result) when
      * the failure is caused by missing permissions (EACCES errno) */
@@ -887,10 +1171,11 @@ quit:
 static int
 drms_have_rights (uid_t uid, gid_t *grouplist, int ngroups)
 {
-    int idx, result;
+    Device *dev;
+    int count, result;
 
-    for ( idx = 0; idx < 16; idx++ ) {
-        result = drm_dev_has_rights (idx, uid, grouplist, ngroups);
+    for ( dev = devices_class (DevDrm, &count); count != 0; dev++, count-- ) {
+        result = drm_dev_has_rights (dev, uid, grouplist, ngroups);
         if ( result )
             return result;
     }
@@ -925,33 +1210,109 @@ drop_user_privileges (gid_t uid)
     return True;
 }
 
+static int
+probe_video (Probe *probe)
+{
+    return video_has_rights (probe->uid, probe->grouplist, probe->ngroups);
+}
+
+static int
+probe_ttys (Probe *probe)
+{
+    return ttys_have_rights (probe->uid, probe->grouplist, probe->ngroups, probe->shareVTs, &probe->chmod);
+}
+
+static int
+probe_events (Probe *probe)
+{
+    return events_have_rights (probe->uid, probe->grouplist, probe->ngroups);
+}
+
+static void *
+probe_run (void *data)
+{
+    Probe *probe = data;
+    long long start;
+
+    start = mono_us ();
+    probe->result = probe->func (probe);
+    probe->time = mono_us () - start;
+    return NULL;
+}
+
 static int
 handle_auto_rights (uid_t uid, gid_t *grouplist, int ngroups, int shareVTs)
 {
-    int result = True;
-    int curr;
-    
-    /* drm */
-    curr = video_has_rights (uid, grouplist, ngroups);
-    if ( curr == DIE )
-        return DIE;
-    if ( !curr )
-        result = False;
+    /* Which VTs are free changes between starts, so ttys are always probed */
+    Probe probes [PROBE_COUNT] = {
+        { .name = "drm", .func = probe_video, .cacheable = True },
+        { .name = "tty", .func = probe_ttys, .cacheable = False },
+        { .name = "input", .func = probe_events, .cacheable = True }
+    };
+    int idx, hit = False, result = True;
+    int cached [PROBE_COUNT];
+    int started [PROBE_COUNT];
+    unsigned long long key = 0;
+    long long start;
+
+    start = mono_us ();
+    if ( u_flags & FlagRightsCache ) {
+        key = cache_key (uid, grouplist, ngroups);
+        hit = cache_lookup (uid, key, cached, PROBE_COUNT);
+    }
 
-    /* tty */
-    curr = ttys_have_rights (uid, grouplist, ngroups, shareVTs);
-    if ( curr == DIE )
-        return DIE;
-    if ( !curr )
-        result = False;
+    /* The probes only read device state so they can overlap; a probe whose
+     * thread can't be created runs inline */
+    for ( idx = 0; idx < PROBE_COUNT; idx++ ) {
+        probes [idx].uid = uid;
+        probes [idx].grouplist = grouplist;
+        probes [idx].ngroups = ngroups;
+        probes [idx].shareVTs = shareVTs;
+
+        started [idx] = False;
+        if ( hit && probes [idx].cacheable ) {
+            probes [idx].result = cached [idx];
+            probes [idx].time = 0;
+            continue;
+        }
 
-    /* input */
-    curr = events_have_rights (uid, grouplist, ngroups);
-    if ( curr == DIE )
-        return DIE;
-    if ( !curr )
-        result = False;
-    
+        started [idx] = pthread_create (&probes [idx].thread, NULL, probe_run, probes + idx) == 0;
+        if ( !started [idx] )
+            probe_run (probes + idx);
+    }
+
+    for ( idx = 0; idx < PROBE_COUNT; idx++ ) {
+        if ( started [idx] )
+            pthread_join (probes [idx].thread, NULL);
+        if ( probes [idx].result == DIE )
+            result = DIE;
+    }
+
+    /* Changing a tty's mode is the only thing a probe leaves behind, so
+     * it waits until no probe failed hard */
+    for ( idx = 0; idx < PROBE_COUNT; idx++ )
+        if ( probes [idx].chmod != NULL && result != DIE )
+            probes [idx].result = tty_dev_chmod (probes [idx].chmod);
+
+    /* Combine in a fixed order so the outcome doesn't depend on timing:
+     * any DIE wins, then any False */
+    result = True;
+    for ( idx = 0; idx < PROBE_COUNT; idx++ ) {
+        debugx ("probe %s: result=%d in %lld us%s", probes [idx].name, probes [idx].result, probes [idx].time,
+            started [idx] ? "" : (hit && probes [idx].cacheable) ? " (cached)" : " (inline)");
+
+        cached [idx] = probes [idx].result;
+        if ( probes [idx].result == DIE )
+            result = DIE;
+        else if ( !probes [idx].result && result != DIE )
+            result = False;
+    }
+
+    /* DIE is an error, not an answer worth remembering */
+    if ( (u_flags & FlagRightsCache) && !hit && result != DIE )
+        cache_store (uid, key, cached, PROBE_COUNT);
+
+    debugx ("device probes finished in %lld us", mono_us () - start);
     return result; 
 }
 
@@ -959,16 +1320,19 @@ int
 check_rights (uid_t uid, int shareVTs)
 {
     gid_t *grouplist;
-    int ngroups, result;
+    int ngroups;
 
     if ( u_flags & FlagDropRootAuto ) {
-        grouplist = get_user_groups (uid, &ngroups);
+        /* Resolved once by ident_resolve () */
+        grouplist = ident_groups (&ngroups);
         if ( grouplist == NULL )
             return DIE;
 
-        result = handle_auto_rights (uid, grouplist, ngroups, shareVTs);
-        free (grouplist);
-        return result;
+        /* One pass over sysfs and /dev shared by all the probes */
+        if ( !devices_scan () )
+            return DIE;
+
+        return handle_auto_rights (uid, grouplist, ngroups, shareVTs);
     }
 
     return u_flags & FlagDropRoot;
@@ -1003,8 +1367,10 @@ error (const char *fmt, ...)
     va_list ap;
 
     va_start (ap, fmt);
+    flockfile (stderr);
     err_begin (fmt, ap);
     err_end ();
+    funlockfile (stderr);
     va_end (ap);
 }
 
@@ -1014,8 +1380,10 @@ errorx (const char *fmt, ...)
     va_list ap;
 
     va_start (ap, fmt);
+    flockfile (stderr);
     err_begin (fmt, ap);
     fputc ( '\n', stderr); 
+    funlockfile (stderr);
     va_end (ap);
 }
 
@@ -19,6 +19,7 @@
 #define _UTIL_H
 
 #define MAX(A, B)  ((A) > (B) ? (A) : (B))
+#define MIN(A, B)  ((A) < (B) ? (A) : (B))
 
 #ifndef True
 #define True  1
@@ -39,12 +40,42 @@ extern const char *prog_name;
 extern char *u_session;
 extern char *u_display;
 extern char *u_server;
+extern int u_server_timeout;
+extern int u_displayfd;
+extern int u_listenfd;
+extern int u_reserve_vt;
+extern int u_term_grace;
+extern int u_kill_grace;
+extern int u_nss_timeout;
+extern char *u_trace_file;
+extern int u_early_client;
+extern int u_prefetch;
+extern int u_pool_size;
+extern int u_pool_recycle;
+extern char *u_pool_screen;
+extern char *u_pool_socket;
+extern int u_restart_max;
+extern int u_restart_backoff;
+extern char *u_cgroup;
+extern char *u_server_cgroup;
+extern char *u_client_cgroup;
+extern char *u_server_output;
+extern char *u_client_output;
+extern int u_output_size;
+extern int u_output_keep;
+extern char *u_metrics;
+extern char *u_sample_file;
+extern int u_sample_interval;
+extern int u_watchdog_interval;
+extern int u_watchdog_stall;
 
 void * x_malloc (int size);
 
 const char * s_basename (const char *path);
 char * s_dup (const char *s);
 void free_util (void);
+long long mono_ms (void);
+long long mono_us (void);
 
 int set_display_env (void);
 int set_session (const char *session);
@@ -0,0 +1,182 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>  /* flock */
+#include <linux/vt.h>  /* VT_OPENQRY */
+
+#include "util.h"
+#include "seat.h"
+#include "vt.h"
+
+
+#define TTY_ZERO  "/dev/tty0"
+#define TTY_PATH  "/dev/tty%d"
+#define VT_LIMIT  63      /* MAX_NR_CONSOLES */
+
+
+/*
+ * With 'reserve-vt' the server's VT is picked here rather than by the
+ * server: VT_OPENQRY names the first free one, and we keep it open until
+ * the end of the session, so nobody else's VT_OPENQRY returns it again.
+ * Launchers like us query under a lock on /dev/tty0, which makes query
+ * and open a single step. A session that logind started on a VT of its
+ * own (XDG_VTNR) keeps the server there, with -keeptty as startx does.
+ */
+static int vtno = 0;              /* 0 for none */
+static int vtfd = -1;
+static int keeptty = False;
+static char vtbuf [8];            /* "vtN" */
+
+
+/*
+ * Code
+ */
+
+static int
+has_vt_arg (char **argv)
+{
+    for ( ; *argv != NULL; argv++ ) {
+        if ( strncmp (*argv, "vt", 2) == 0 && isdigit ((unsigned char) (*argv) [2]) )
+            return True;
+    }
+    return False;
+}
+
+static int
+session_vt (void)
+{
+    const char *env;
+    char *end;
+    long num;
+
+    env = getenv ("XDG_VTNR");
+    if ( env == NULL || *env == '\0' )
+        return 0;
+
+    num = strtol (env, &end, 10);
+    if ( *end != '\0' || num <= 0 || num > VT_LIMIT ) {
+        debugx ("ignoring XDG_VTNR=%s", env);
+        return 0;
+    }
+    return num;
+}
+
+static int
+reserve (void)
+{
+    char path [16];
+    int fd, num = -1;
+
+    fd = open (TTY_ZERO, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+    if ( fd == -1 ) {
+        debug ("could not open %s", TTY_ZERO);
+        return 0;
+    }
+
+    /* Released by close () */
+    flock (fd, LOCK_EX);
+
+    if ( ioctl (fd, VT_OPENQRY, &num) == -1 ) {
+        debug ("%s: VT_OPENQRY failed", TTY_ZERO);
+        goto quit;
+    }
+    if ( num <= 0 || num > VT_LIMIT ) {
+        debugx ("no free VT");
+        goto quit;
+    }
+
+    snprintf (path, sizeof (path), TTY_PATH, num);
+    vtfd = open (path, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+    if ( vtfd == -1 ) {
+        debug ("could not open %s", path);
+        num = 0;
+    }
+
+quit:
+
+    close (fd);
+    return MAX (num, 0);
+}
+
+/*
+ * Before check_rights (), whose tty probe looks at the VT settled here.
+ * Not fatal: without a VT of ours the server looks for one itself.
+ */
+void
+vt_claim (char **server_argv, int shareVTs)
+{
+    /* Only seat0 has VTs */
+    if ( !u_reserve_vt || shareVTs || has_vt_arg (server_argv) ||
+         (seat_name () != NULL && strcmp (seat_name (), "seat0") != 0) )
+        return;
+
+    vtno = session_vt ();
+    if ( vtno != 0 ) {
+        keeptty = True;
+        debugx ("server stays on the session's VT %d", vtno);
+    } else {
+        vtno = reserve ();
+        if ( vtno == 0 )
+            return;
+        debugx ("reserved VT %d", vtno);
+    }
+    snprintf (vtbuf, sizeof (vtbuf), "vt%d", vtno);
+}
+
+/* 0 when the server picks its VT itself */
+int
+vt_number (void)
+{
+    return vtno;
+}
+
+/* The server's "vtN" argument, NULL for none */
+char *
+vt_arg (void)
+{
+    return vtno != 0 ? vtbuf : NULL;
+}
+
+int
+vt_keeptty (void)
+{
+    return keeptty;
+}
+
+/* At the end of the session, once the server is gone */
+void
+vt_release (void)
+{
+    if ( vtfd != -1 ) {
+        close (vtfd);
+        vtfd = -1;
+    }
+    vtno = 0;
+    keeptty = False;
+}
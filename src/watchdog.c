@@ -0,0 +1,260 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/socket.h>  /* shutdown */
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+#include "util.h"
+#include "loop.h"
+#include "watchdog.h"
+
+
+#define WATCHDOG_ATOM     "_XINIT_WATCHDOG"
+#define WATCHDOG_BUCKETS  128     /* log-linear, 4 per power of two */
+
+
+/*
+ * Round-trip monitor, on with 'watchdog-interval': every so many ms a
+ * zero-length append to a property of an unmapped window of our own goes
+ * down the connection xinit keeps open, and the PropertyNotify coming
+ * back ends the round trip. Nothing of it blocks: the request is tiny and
+ * there is only ever one in flight, and the answer is picked up when the
+ * main loop finds the connection readable. A round trip outstanding for
+ * 'watchdog-stall' ms makes watchdog_tick () report the server hung.
+ *
+ * Latencies go into a log-linear histogram: values below 4 us have a
+ * bucket each, above that every power of two is split into 4.
+ */
+static Display *dpy = NULL;       /* not ours, NULL when stopped */
+static Window win;
+static Atom atom;
+static long long sent = 0;        /* us, 0 with nothing in flight */
+static long long next_ping;       /* ms */
+
+static unsigned long histogram [WATCHDOG_BUCKETS];
+static unsigned long count = 0;
+static long long total = 0;       /* us */
+static long long slowest = 0;     /* us */
+
+static jmp_buf io_env;
+
+
+/*
+ * Code
+ */
+
+static int
+bucket (long long us)
+{
+    int exp;
+
+    if ( us < 4 )
+        return us < 0 ? 0 : us;
+
+    for ( exp = 2; (us >> (exp + 1)) != 0; exp++ )
+        ;  /* NOP */
+
+    return MIN (4 * (exp - 1) + ((us >> (exp - 2)) & 3), WATCHDOG_BUCKETS - 1);
+}
+
+/* The highest value a bucket holds */
+static long long
+bucket_top (int idx)
+{
+    int exp = idx / 4 + 1;
+
+    if ( idx < 4 )
+        return idx;
+
+    return ((long long) (4 + idx % 4 + 1) << (exp - 2)) - 1;
+}
+
+long long
+watchdog_quantile (double q)
+{
+    unsigned long seen = 0, rank;
+    int idx;
+
+    if ( count == 0 )
+        return -1;
+
+    rank = (unsigned long) (q * count + 0.5);
+    for ( idx = 0; idx < WATCHDOG_BUCKETS; idx++ ) {
+        seen += histogram [idx];
+        if ( seen >= rank && seen != 0 )
+            return MIN (bucket_top (idx), slowest);
+    }
+    return slowest;
+}
+
+unsigned long
+watchdog_count (long long *sum)
+{
+    *sum = total;
+    return count;
+}
+
+static int
+io_error (Display *display)
+{
+    longjmp (io_env, 1);
+
+    /* NOTREACHED */
+    return 0;
+}
+
+/*
+ * Whatever Xlib has for us, read from the socket or already queued by
+ * someone else's request. False once the connection is gone: Xlib would
+ * exit () on us, so its handler is ours meanwhile.
+ */
+static int
+pick_up (void)
+{
+    XIOErrorHandler old;
+    XEvent ev;
+    long long now;
+    int alive = True;
+
+    old = XSetIOErrorHandler (io_error);
+    if ( setjmp (io_env) == 0 ) {
+        while ( XPending (dpy) > 0 ) {
+            XNextEvent (dpy, &ev);
+            if ( ev.type != PropertyNotify || ev.xproperty.window != win || sent == 0 )
+                continue;
+
+            now = mono_us ();
+            histogram [bucket (now - sent)]++;
+            count++;
+            total += now - sent;
+            slowest = MAX (slowest, now - sent);
+            sent = 0;
+            next_ping = now / 1000 + u_watchdog_interval;
+        }
+    } else
+        alive = False;
+    XSetIOErrorHandler (old);
+
+    return alive;
+}
+
+void
+watchdog_start (Display *display)
+{
+    XSetWindowAttributes attrs;
+
+    if ( u_watchdog_interval == 0 || display == NULL || dpy != NULL )
+        return;
+
+    /* Round trips of its own, the server has just come up */
+    attrs.event_mask = PropertyChangeMask;
+    win = XCreateWindow (display, DefaultRootWindow (display), -1, -1, 1, 1, 0, 0,
+        InputOnly, CopyFromParent, CWEventMask, &attrs);
+    atom = XInternAtom (display, WATCHDOG_ATOM, False);
+    XSync (display, False);
+
+    if ( !loop_watch_fd (ConnectionNumber (display)) ) {
+        XDestroyWindow (display, win);
+        return;
+    }
+    dpy = display;
+    sent = 0;
+    next_ping = mono_ms ();
+    debugx ("watchdog: round trip every %d ms, hung after %d ms", u_watchdog_interval, u_watchdog_stall);
+}
+
+/* The main loop's LoopFd, -1 when stopped */
+int
+watchdog_fd (void)
+{
+    return dpy != NULL ? ConnectionNumber (dpy) : -1;
+}
+
+/* When watchdog_tick () wants to run next, -1 for never */
+long long
+watchdog_deadline (void)
+{
+    if ( dpy == NULL )
+        return -1;
+
+    return sent != 0 ? sent / 1000 + u_watchdog_stall : next_ping;
+}
+
+/* On watchdog_fd () events and at watchdog_deadline (): False when the
+ * server is hung */
+int
+watchdog_tick (void)
+{
+    long long now;
+
+    if ( dpy == NULL )
+        return True;
+
+    if ( !pick_up () ) {
+        watchdog_stop ();
+        return True;      /* a dead server is the main loop's business */
+    }
+
+    now = mono_us ();
+    if ( sent != 0 ) {
+        if ( now - sent < u_watchdog_stall * 1000LL )
+            return True;
+
+        errorx ("X server has not answered for %lld ms", (now - sent) / 1000);
+
+        /* XCloseDisplay () would wait on it too: make it fail fast */
+        shutdown (ConnectionNumber (dpy), SHUT_RDWR);
+        watchdog_stop ();
+        return False;
+    }
+
+    if ( now / 1000 >= next_ping ) {
+        XChangeProperty (dpy, win, atom, XA_CARDINAL, 32, PropModeAppend, NULL, 0);
+        sent = mono_us ();
+        XFlush (dpy);
+
+        /* XFlush () reads what has come in meanwhile, the answer too */
+        if ( !pick_up () ) {
+            watchdog_stop ();
+            return True;
+        }
+    }
+    return True;
+}
+
+/* Before the connection is closed; the window goes with it */
+void
+watchdog_stop (void)
+{
+    if ( dpy == NULL )
+        return;
+
+    loop_unwatch_fd (ConnectionNumber (dpy));
+    dpy = NULL;
+
+    if ( count != 0 )
+        debugx ("watchdog: %lu round trips, p50 %lld us, p99 %lld us, slowest %lld us",
+            count, watchdog_quantile (0.5), watchdog_quantile (0.99), slowest);
+}
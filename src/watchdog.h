@@ -0,0 +1,33 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+#ifndef _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include <X11/Xlib.h>
+
+
+void watchdog_start (Display *display);
+int watchdog_fd (void);
+long long watchdog_deadline (void);
+int watchdog_tick (void);
+long long watchdog_quantile (double q);
+unsigned long watchdog_count (long long *sum);
+void watchdog_stop (void);
+
+
+#endif  /* _WATCHDOG_H */
@@ -39,6 +39,7 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <poll.h>
 
 #ifdef __APPLE__
 #include <AvailabilityMacros.h>
@@ -47,13 +48,28 @@
 #endif
 #endif
 
-/* For PRIO_PROCESS and setpriority() */
-#include <sys/time.h>
-#include <sys/resource.h>
-
 #include <stdlib.h>
 
 #include "util.h"
+#include "capture.h"
+#include "cgroup.h"
+#include "tune.h"
+#include "devices.h"
+#include "display.h"
+#include "gate.h"
+#include "ident.h"
+#include "loop.h"
+#include "metrics.h"
+#include "pool.h"
+#include "prefetch.h"
+#include "ready.h"
+#include "restart.h"
+#include "sample.h"
+#include "seat.h"
+#include "spawn.h"
+#include "trace.h"
+#include "vt.h"
+#include "watchdog.h"
 
 
 #ifndef SHELL
@@ -85,27 +101,34 @@ static char xinitrcbuf [256];
 static char *clientargv [96];
 static char **client = clientargv + 2;  /* make sure room for sh .xinitrc args */
 static pid_t clientpid = -1;
+static Spawn clientspawn;             /* exec'd only after the gate with 'early-client' */
 
 static const char xserverrc [] = "/xorg/xserverrc";
 static char xserverrcbuf [256];
 static char *serverargv [96];
 static char **server = serverargv + 2;  /* make sure room for sh .xserverrc args */
 static pid_t serverpid = -1;
+static long long forktime;            /* when the server was forked */
 
 #ifdef __sun
 static const char *kbd_mode = "/usr/bin/kbd_mode";
 #endif
 
 static Display *xd = NULL;            /* server connection */
-static volatile int gotSignal = 0;
+static int gotSignal = 0;
 static int status;   
+static Bool serverDied = False;       /* a restart has to start the server too */
 
-static void ExecuteXorg (char **vec, Bool elevated_rights);
-static void ExecuteRelative (char **vec); 
 static Bool waitforserver (void);
 static Bool processTimeout (int timeout, const char *string);
+static void sessionChanged (pid_t server, pid_t client);
+static long long earliest (long long a, long long b);
 static pid_t startServer (char *server[], Bool use_execve);
 static pid_t startClient (char *client[], uid_t euid, uid_t uid);
+static Bool releaseClient (uid_t euid, uid_t uid);
+static Bool startSeat (int at, int *start_of_args);
+static Bool restartSession (uid_t uid);
+static void closeDisplay (void);
 static int ignorexio (Display *dpy);
 static Bool shutdown (void);
 
@@ -114,47 +137,6 @@ static Bool shutdown (void);
  * Code
  */
 
-static void
-sigCatch (int sig)
-{
-    /* On system with POSIX signals, just interrupt the system call */
-    gotSignal = sig;
-}
-
-static void
-sigIgnore (int sig)
-{
-    /* NOP */
-}
-
-static void
-ExecuteXorg (char **argv, Bool elevated_rights)
-{
-    char *const empty_envp[1] = { NULL };
-
-    if ( elevated_rights )
-        execve (*argv, argv, empty_envp);
-    else
-        execv (*argv, argv); 
-}
-
-static void
-ExecuteRelative (char **vec)  /* has room from up above */
-{
-    char *s = *vec;
-
-    execvp (s, vec);
-
-    if ( access (s, R_OK) != 0 )
-        return;
-
-    /* back it up to stuff shell in */
-    s = (char *) SHELL;
-    vec--;
-    *vec = s;
-    execvp (s, vec);
-}
-
 int
 main (int argc, char *argv[])
 {
@@ -166,12 +148,15 @@ main (int argc, char *argv[])
     register char **sptr;
     register char **cptr;
     int client_given = False, server_given = False;
-    int start_of_client_args, start_of_server_args, result;
-    struct sigaction sa, si;
+    int pool = False, leased = False;
+    int start_of_client_args, start_of_server_args, display_at, result;
     uid_t uid, euid;
-    pid_t pid;
+    LoopEvent ev;
+    long long deadline, now, restart_at = -1, delay;
     int shareVTs = False;
-    char *home, *xdg_config, *cp;
+    const char *home;
+    char *xdg_config, *cp;
+    long long start;
     char c;
 
     /*
@@ -180,14 +165,28 @@ main (int argc, char *argv[])
     prog_name = s_basename (*argv++);
     argc--;
 
+    /* "xinit -pool [-- server args]" runs a server pool, see pool.c */
+    if ( argc != 0 && strcmp (*argv, "-pool") == 0 ) {
+        pool = True;
+        argv++;
+        argc--;
+    }
+
+    /* The trace file is only known once the config is read */
+    start = mono_us ();
     if ( !parse_config () )
         goto quit;
 
+    if ( u_trace_file != NULL && trace_open (u_trace_file) )
+        trace_span ("parse_config", start);
+
     /*
      * copy the client args.
      */
     c = argc != 0 ? **argv : '\0';
-    if ( c != '/' && c != '.' )
+    if ( pool )
+        cptr = client;  /* the leasing xinit runs the clients */
+    else if ( c != '/' && c != '.' )
         cptr = add_args (client, u_session);
     else {
         cptr = client;
@@ -230,26 +229,44 @@ main (int argc, char *argv[])
     }
 
     /* display */
-    if ( argc == 0 )
-        *sptr++ = u_display;
-    else {
-        cp = *argv;
-        if ( *cp != ':' || !isdigit (cp [1]) )
-            *sptr++ = u_display;
-        else if ( !set_display (cp) )
-            goto quit;
-    }
+    display_at = sptr - server;
+    if ( argc == 0 || **argv != ':' || !isdigit ((*argv) [1]) ) {
+        /* Claim a free display through its lock file; should that fail
+         * the server picks one and tells us via -displayfd. With several
+         * seats each one claims its own, see startSeat (); pool servers
+         * always report theirs. With 'pool-size' a ready server is leased
+         * from the pool, if one runs */
+        if ( seat_count () != 0 || pool ) {
+            if ( u_display != NULL ) {
+                errorx (pool ? "a display cannot be given to a server pool" : "a display cannot be given with several seats");
+                goto quit;
+            }
+        } else if ( u_pool_size > 0 && u_display == NULL && pool_lease () ) {
+            leased = True;
+        } else {
+            if ( u_display == NULL && !display_claim () && !u_displayfd )
+                goto quit;
+
+            if ( u_display != NULL )
+                *sptr++ = u_display;
+        }
+    } else if ( seat_count () != 0 || pool ) {
+        errorx (pool ? "a display cannot be given to a server pool" : "a display cannot be given with several seats");
+        goto quit;
+    } else if ( !set_display (*argv) )
+        goto quit;
 
     /* ShareVTs argument */
     start_of_server_args = sptr - server;
-    while ( --argc != 0 ) {
+    while ( argc-- > 0 ) {
         /* ShareVTs */
         cp = *argv++;
         if ( strcmp (cp, "-sharevts") == 0 ) {
             debugx ("found 'sharevts' argument");
             shareVTs = True;
         }
-        if ( sptr > serverargv + countof (serverargv) - 2 ) {
+        /* keep room for what startServer () adds */
+        if ( sptr > serverargv + countof (serverargv) - 10 ) {
             errorx ("too many server arguments");
             goto quit;
         }
@@ -260,12 +277,56 @@ main (int argc, char *argv[])
     /* Is user allowed to launch X server and does (s)he really need
      * the root permissions ?? */
     uid = getuid ();
+    start = mono_us ();
     if ( !is_user_allowed (uid) )
         goto quit;
+    trace_span ("is_user_allowed", start);
 
-    result = check_rights (uid, shareVTs);
-    if ( result == DIE )
+    /* Home and groups are looked up once and shared with check_rights () */
+    start = mono_us ();
+    if ( !ident_resolve (uid) )
         goto quit;
+    trace_span ("ident_resolve", start);
+
+    /* Seats share the identity and the device inventory: one child per
+     * seat goes on from here, we stay as their supervisor */
+    if ( seat_count () != 0 ) {
+        if ( !devices_scan () )
+            goto quit;
+
+        /* The delegated cgroup is set up once, each seat gets a subtree */
+        cgroup_setup ();
+
+        result = seat_fork ();
+        if ( result == DIE )
+            goto quit;
+
+        if ( !result ) {
+            result = seat_supervise ();
+            cgroup_release ();
+            trace_close ();
+            free_util ();
+            return result ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        if ( !startSeat (display_at, &start_of_server_args) )
+            goto quit;
+    }
+
+    /* Neither pool servers nor a leased one touch any device: the rest
+     * runs with the user's rights */
+    if ( pool || leased )
+        result = True;
+    else {
+        /* The tty probe looks at the VT the server will get */
+        vt_claim (server, shareVTs);
+
+        start = mono_us ();
+        result = check_rights (uid, shareVTs);
+        trace_span ("check_rights", start);
+        if ( result == DIE )
+            goto quit;
+    }
 
     if ( result && !drop_user_privileges (uid) )
         goto quit;
@@ -274,7 +335,8 @@ main (int argc, char *argv[])
      * if no client arguments given, check for a startup file and copy
      * that into the argument list
      */
-    home = getenv ("HOME");
+    start = mono_us ();
+    home = ident_home ();
     xdg_config = getenv ("XDG_CONFIG_HOME");
 
     if ( !client_given ) {
@@ -323,39 +385,36 @@ main (int argc, char *argv[])
                 error("warning, no server init file \"%s\"", xserverrcbuf);
         }
     }
+    trace_span ("xinitrc/xserverrc lookup", start);
     /*
      * Check execute permissions
      */
 
-    if ( !check_execute_rights (*server) )
+    if ( !leased && !check_execute_rights (*server) )
         goto quit;
 
-    return 0;
+    if ( pool ) {
+        result = pool_run (server);
+        trace_close ();
+        free_util ();
+        return result ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
     /*
      * Start the server and client.
      */
     signal (SIGCHLD, SIG_DFL);    /* Insurance */
 
-    /* Let those signal interrupt the wait() call in the main loop */
-    memset (&sa, 0, sizeof (sa));
-    sa.sa_handler = sigCatch;
-    sigemptyset (&sa.sa_mask);
-    sa.sa_flags = 0;    /* do not set SA_RESTART */
+    /* Server and client each get a cgroup of their own, see 'cgroup' */
+    cgroup_setup ();
 
-    sigaction (SIGTERM, &sa, NULL);
-    sigaction (SIGQUIT, &sa, NULL);
-    sigaction (SIGINT, &sa, NULL);
-    sigaction (SIGHUP, &sa, NULL);
-    sigaction (SIGPIPE, &sa, NULL);
+    /* CPUs and NUMA memory policy, see 'server-cpus' and 'server-numa' */
+    tune_prepare ();
 
-    memset (&si, 0, sizeof (si));
-    si.sa_handler = sigIgnore;
-    sigemptyset (&si.sa_mask);
-    si.sa_flags = SA_RESTART;
-
-    sigaction (SIGALRM, &si, NULL);
-    sigaction (SIGUSR1, &si, NULL);
+    /* Server start, the session and shutdown all run through one epoll
+     * loop: children are watched by pidfd, signals come from a signalfd */
+    if ( !loop_init () )
+        goto quit;
 
 #ifdef __APPLE__
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
@@ -363,16 +422,123 @@ main (int argc, char *argv[])
 #endif
 #endif
 
+    /* Warm the page cache with the last session's files meanwhile */
+    prefetch_start (uid);
+
     euid = geteuid ();
-    if ( startServer (server, uid != euid) == -1 )
-        goto quit;
+    if ( leased ) {
+        if ( startClient (client, euid, uid) == -1 ) {
+            shutdown ();
+            goto quit;
+        }
+    } else if ( u_early_client ) {
+        /* The client gets ready alongside the server, see releaseClient () */
+        if ( startClient (client, euid, uid) == -1 ) {
+            shutdown ();
+            goto quit;
+        }
 
-    if ( startClient (client, euid, uid) == -1 )
-        goto quit;
+        if ( startServer (server, uid != euid) == -1 )
+            goto quit;
+
+        if ( !releaseClient (euid, uid) )
+            goto quit;
+    } else {
+        if ( startServer (server, uid != euid) == -1 )
+            goto quit;
 
-    pid = -1;
-    while ( pid != clientpid && pid != serverpid && gotSignal == 0 ) {
-        pid = wait (NULL);
+        if ( startClient (client, euid, uid) == -1 ) {
+            shutdown ();
+            goto quit;
+        }
+    }
+
+    prefetch_record (serverpid, clientpid);
+    restart_started ();
+
+    /* The display is known now, it names the metrics socket */
+    sessionChanged (serverpid, clientpid);
+
+    /* An early client may already be gone while we waited for the server */
+    while ( gotSignal == 0 && (loop_has_pid (clientpid) || restart_at != -1) ) {
+        deadline = earliest (prefetch_deadline (), restart_at);
+        deadline = earliest (deadline, watchdog_deadline ());
+
+        result = loop_wait (deadline, &ev);
+        if ( result == LoopError )
+            break;
+
+        /* The only descriptor watched here is the watchdog's */
+        if ( result == LoopTimeout || result == LoopFd ) {
+            now = mono_ms ();
+            if ( restart_at != -1 && now >= restart_at ) {
+                restart_at = -1;
+                if ( !restartSession (uid) )
+                    break;
+                continue;
+            }
+
+            /* A hung server is taken down as at the end of a session,
+             * and started again if 'restart-max' allows */
+            if ( !watchdog_tick () ) {
+                if ( !shutdown () )
+                    break;
+
+                delay = restart_delay (status, True);
+                serverpid = -1;
+                if ( delay < 0 )
+                    break;
+
+                serverDied = True;
+                sessionChanged (serverpid, clientpid);
+                restart_at = mono_ms () + delay;
+                continue;
+            }
+
+            if ( prefetch_deadline () != -1 && now >= prefetch_deadline () )
+                prefetch_sample ();
+            continue;
+        }
+
+        if ( result == LoopSignal ) {
+            if ( ev.signo != SIGUSR1 )
+                gotSignal = ev.signo;
+            continue;
+        }
+
+        /* Both end the session, unless 'restart-max' allows a restart */
+        if ( result == LoopExit && ev.pid == serverpid ) {
+            status = ev.status;
+            sample_exited (SampleServer, ev.status, &ev.rusage);
+            capture_exited (CaptureServer, ev.status);
+            delay = restart_delay (ev.status, True);
+            if ( delay < 0 )
+                break;
+
+            /* The client goes with its server, whatever remains of it
+             * is not waited for */
+            closeDisplay ();
+            if ( clientpid > 0 && killpg (clientpid, SIGHUP) < 0 && errno != ESRCH )
+                error ("can't send HUP to process group %d", clientpid);
+
+            serverpid = -1;
+            serverDied = True;
+            sessionChanged (serverpid, clientpid);
+            restart_at = mono_ms () + delay;
+        } else if ( result == LoopExit && ev.pid == clientpid && restart_at == -1 ) {
+            sample_exited (SampleClient, ev.status, &ev.rusage);
+            capture_exited (CaptureClient, ev.status);
+            delay = restart_delay (ev.status, False);
+            if ( delay < 0 )
+                break;
+
+            /* What the crashed client left behind */
+            if ( killpg (clientpid, SIGHUP) < 0 && errno != ESRCH )
+                error ("can't send HUP to process group %d", clientpid);
+
+            sessionChanged (serverpid, -1);
+            restart_at = mono_ms () + delay;
+        }
     }
 
 #ifdef __APPLE__
@@ -381,20 +547,22 @@ main (int argc, char *argv[])
 #endif
 #endif
 
-    signal (SIGTERM, SIG_IGN);
-    signal (SIGQUIT, SIG_IGN);
-    signal (SIGINT, SIG_IGN);
-    signal (SIGHUP, SIG_IGN);
-    signal (SIGPIPE, SIG_IGN);
-
-    if ( !shutdown () )
+    /* From now on the supervised signals are read and dropped */
+    start = mono_us ();
+    result = shutdown ();
+    trace_span ("shutdown", start);
+    pool_return ();
+    restart_report ();
+    if ( !result )
         goto quit;
 
+    prefetch_save (uid);
+
     if ( gotSignal != 0 ) {
         errorx ("unexpected signal %d", gotSignal);
         goto quit;
     }
-    if ( serverpid < 0 ) {
+    if ( serverpid < 0 && !leased ) {
         errorx ("server error");
         goto quit;
     }
@@ -402,10 +570,29 @@ main (int argc, char *argv[])
         errorx ("client error");
         goto quit;
     }
+    capture_close ();
+    metrics_close ();
+    sample_close ();
+    loop_close ();
+    cgroup_release ();
+    display_release ();
+    ready_release ();
+    vt_release ();
+    trace_close ();
     return EXIT_SUCCESS;
 
 quit:
 
+    gate_close ();
+    capture_close ();
+    metrics_close ();
+    sample_close ();
+    loop_close ();
+    cgroup_release ();
+    display_release ();
+    ready_release ();
+    vt_release ();
+    trace_close ();
     free_util ();
     return EXIT_FAILURE;
 }
@@ -417,8 +604,7 @@ quit:
 static Bool
 waitforserver(void)
 {
-    int ncycles = 120;        /* # of cycles to wait */
-    int cycles;            /* Wait cycle count */
+    Ready how;
 
 #ifdef __APPLE__
     /* For Apple, we don't get signaled by the server when it's ready, so we just
@@ -430,145 +616,223 @@ waitforserver(void)
     sleep(2);
 #endif
 
-    for ( cycles = 0; cycles < ncycles; cycles++ ) {
+    /* Whatever comes first: -displayfd, SIGUSR1 or a listening socket */
+    how = ready_wait (serverpid, &status);
+
+    /* The probe on our own socket goes only once we are connected: the
+     * server resets when its last client leaves */
+    if ( how > ReadyTimeout ) {
         xd = XOpenDisplay (u_display);
-        if ( xd != NULL )
+        ready_close ();
+        if ( xd != NULL ) {
+            debugx ("X server ready after %lld ms (%s)", mono_ms () - forktime, ready_name (how));
+            metrics_ready (ready_name (how), mono_ms () - forktime);
+            prefetch_server (serverpid);
             return True;
-        
-        if ( !processTimeout (1, "X server to begin accepting connections") )
-            break;
-    }
+        }
+        errorx ("X server is ready (%s) but %s refuses connections", ready_name (how), u_display);
+    } else
+        ready_close ();
+
+    /* Whatever it had to say about it */
+    if ( !loop_has_pid (serverpid) )
+        capture_exited (CaptureServer, status);
     errorx ("giving up");
     return False;
 }
 
+static Bool
+stderrWritable (void)
+{
+    struct pollfd pfd = { STDERR_FILENO, POLLOUT, 0 };
+
+    return poll (&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
 /*
- * return True if we timeout waiting for pid to exit, False otherwise.
+ * return True if we timeout waiting for the server to exit, False otherwise.
+ * 'timeout' is in milliseconds, progress is printed once per second.
  */
 static Bool
 processTimeout (int timeout, const char *string)
 {
-    int i = 0;
-    pid_t pidfound = -1;
-    static const char *laststring = NULL;
+    LoopEvent ev;
+    long long now, deadline, tick;
+    int dots = 0;
 
-    for ( ;; ) {
-        pidfound = waitpid(serverpid, &status, WNOHANG);
-        if ( pidfound == serverpid )
+    deadline = mono_ms () + timeout;
+
+    while ( loop_has_pid (serverpid) ) {
+        now = mono_ms ();
+        if ( now >= deadline )
             break;
 
-        if (timeout) {
-            if ( i == 0 && string != laststring ) {
-                /* 'string' should not be null, but let's make the
-                 * code safe enough */
-                if ( string != NULL )
-                    fprintf (stderr, "\r\nwaiting for %s ", string);
-                else {
-                    fputc ('\r', stderr);
-                    fputc ('\n', stderr);
-                }
+        tick = MIN (now + 1000, deadline);
+        switch (loop_wait (tick, &ev)) {
+        case LoopExit:
+            if ( ev.pid == serverpid ) {
+                status = ev.status;
+                sample_exited (SampleServer, ev.status, &ev.rusage);
             }
+            break;
+
+        case LoopTimeout:
+            /* Only what stderr takes right away: a stuck terminal must
+             * not keep the loop from draining the server's output */
+            if ( !stderrWritable () )
+                break;
+
+            if ( dots++ == 0 )
+                fprintf (stderr, "\r\nwaiting for %s ", string != NULL ? string : "X server");
             else
                 fputc ('.', stderr);
 
-            fflush(stderr);
-            sleep(1);
-        }
+            fflush (stderr);
+            break;
 
-        if ( ++i > timeout )
+        case LoopError:
+            return True;
+
+        default:
+            /* signals are ignored while we wait */
             break;
+        }
     }
 
-    if ( i > 0 )
+    if ( dots > 0 )
         fputc ('\n', stderr);     /* tidy up after message */
 
-    laststring = string;
-    return serverpid != pidfound;
+    return loop_has_pid (serverpid);
+}
+
+static int
+serverSetup (void *data)
+{
+    /* Runs between clone3 () and exec: async-signal-safe calls only */
+    loop_child ();
+
+    /*
+     * don't hang on read/write to control tty
+     */
+    signal (SIGTTIN, SIG_IGN);
+    signal (SIGTTOU, SIG_IGN);
+    /*
+     * ignore SIGUSR1 in child.  The server
+     * will notice this and send SIGUSR1 back
+     * at xinit when ready to accept connections
+     */
+    signal (SIGUSR1, SIG_IGN);
+    /*
+     * prevent server from getting sighup from vhangup()
+     * if client is xterm -L
+     */
+    setpgid (0, getpid());
+    tune_child (TuneServer);
+    capture_child (CaptureServer);
+    ready_child ();
+    display_child ();
+    trace_instant_safe ("server exec");
+    return True;
 }
 
 static pid_t
 startServer (char *server_argv[], Bool elevated_rights)
 {
-    sigset_t mask, old;
+    static char *empty_envp [1] = { NULL };
+    static char **ours = NULL;    /* where our arguments go */
     const char * const *cpp;
+    char **argp, *vt, *displayfd, *listenfd;
+    long long start;
+    Spawn sp;
+    Bool result;
+    int pidfd, idx;
 
     debugx ("starting server %s", server_argv[0]);
 
-    sigemptyset (&mask);
-    sigaddset (&mask, SIGUSR1);
-    sigprocmask (SIG_BLOCK, &mask, &old);
-
-    serverpid = fork ();
-    debugx ("server forked: pid=%d", serverpid);
-    
-    switch (serverpid) {
-    case 0:
-        /* Unblock */
-        sigprocmask (SIG_SETMASK, &old, NULL);
-
-        /*
-         * don't hang on read/write to control tty
-         */
-        signal (SIGTTIN, SIG_IGN);
-        signal (SIGTTOU, SIG_IGN);
-        /*
-         * ignore SIGUSR1 in child.  The server
-         * will notice this and send SIGUSR1 back
-         * at xinit when ready to accept connections
-         */
-        signal (SIGUSR1, SIG_IGN);
-        /*
-         * prevent server from getting sighup from vhangup()
-         * if client is xterm -L
-         */
-        setpgid (0, getpid());
-        ExecuteXorg (server_argv, elevated_rights);
-
-        error ("unable to run server \"%s\"", *server_argv);
-        fprintf (stderr, "Use the -- option, or make sure that \"%s\" is a program or a link to the right type of server for your display.  Possible server names include:\n", *server_argv);
-
-        for ( cpp = server_names; *cpp; cpp++ )
-            fprintf (stderr, "    %s\n", *cpp);
-
-        fprintf (stderr, "\n");
+    /* SIGUSR1 is already blocked by loop_init () */
+    if ( !ready_prepare () )
         return -1;
- 
-    case -1:
-        break;
- 
-    default:
-        /*
-         * don't nice server
-         */
-        setpriority (PRIO_PROCESS, serverpid, -1);
 
-        errno = 0;
-        if ( !processTimeout (0, NULL) ) {
-            serverpid = -1;
-            break;
-        }
-        /*
-         * kludge to avoid race with TCP, giving server time to
-         * set his socket options before we try to open it,
-         * either use the 15 second timeout, or await SIGUSR1.
-         *
-         * If your machine is substantially slower than 15 seconds,
-         * you can easily adjust this value.
-         */
-        alarm (15);
-
-        sigsuspend (&old);
-        alarm (0);
-        sigprocmask (SIG_SETMASK, &old, NULL);
-
-        if ( waitforserver () == 0 ) {
-            error ("unable to connect to X server");
-            shutdown ();
-            serverpid = -1;
-            return -1;
+    /* main () keeps room for these; a restarted server gets a new pipe
+     * and new sockets in place of the old ones */
+    if ( ours == NULL ) {
+        for ( ours = server_argv; *ours != NULL; ours++ )
+            ;  /* NOP */
+    }
+
+    argp = ours;
+    vt = vt_arg ();
+    if ( vt != NULL ) {
+        *argp++ = vt;
+        if ( vt_keeptty () )
+            *argp++ = (char *) "-keeptty";
+    }
+    displayfd = ready_displayfd ();
+    if ( displayfd != NULL ) {
+        *argp++ = (char *) "-displayfd";
+        *argp++ = displayfd;
+    }
+    for ( idx = 0; (listenfd = ready_listenfd (idx)) != NULL; idx++ ) {
+        *argp++ = (char *) "-listenfd";
+        *argp++ = listenfd;
+    }
+    *argp = NULL;
+
+    /* stdout and stderr into a pipe of ours, see 'server-output' */
+    capture_prepare (CaptureServer);
+
+    spawn_init (&sp, server_argv);
+    sp.envp = elevated_rights ? empty_envp : NULL;
+    sp.setup = serverSetup;
+    sp.safe = True;
+    sp.cgroup = cgroup_fd (CgroupServer);
+
+    /* Returns once the server has been exec'd, or failed to */
+    start = mono_us ();
+    forktime = mono_ms ();
+    serverpid = spawn (&sp, &pidfd);
+    spawn_close (&sp);
+    capture_parent (CaptureServer);
+    debugx ("server spawned: pid=%d", serverpid);
+
+    if ( serverpid == -1 ) {
+        if ( errno != 0 ) {
+            error ("unable to run server \"%s\"", *server_argv);
+            fprintf (stderr, "Use the -- option, or make sure that \"%s\" is a program or a link to the right type of server for your display.  Possible server names include:\n", *server_argv);
+
+            for ( cpp = server_names; *cpp; cpp++ )
+                fprintf (stderr, "    %s\n", *cpp);
+
+            fprintf (stderr, "\n");
         }
-        break;
+        ready_close ();
+        return -1;
     }
+    trace_span ("server spawn", start);
+    tune_report (TuneServer, serverpid);
+
+    /* The server's nice value and any boost are set in serverSetup (),
+     * see 'server-sched' */
+    ready_parent ();
+
+    if ( !loop_watch_pidfd (serverpid, pidfd) ) {
+        ready_close ();
+        return -1;
+    }
+
+    /* see 'server-timeout' in the config file */
+    start = mono_us ();
+    result = waitforserver ();
+    trace_span ("waitforserver", start);
+    if ( !result ) {
+        error ("unable to connect to X server");
+        shutdown ();
+        serverpid = -1;
+        return -1;
+    }
+
+    /* Ready: the boost is over */
+    tune_settle (TuneServer, serverpid);
     return serverpid;
 }
 
@@ -582,6 +846,8 @@ setWindowPath (void)
     unsigned long nitems;
     unsigned long bytes_after;
     unsigned char *buf;
+    static char *inherited = NULL;
+    static Bool saved = False;
     const char *windowpath;
     char *newwindowpath;
     unsigned long num;
@@ -636,7 +902,14 @@ setWindowPath (void)
     }
 
     XFree (buf);
-    windowpath = getenv ("WINDOWPATH");
+
+    /* After a server restart it is done again, on top of what we got */
+    if ( !saved ) {
+        windowpath = getenv ("WINDOWPATH");
+        inherited = windowpath != NULL ? s_dup (windowpath) : NULL;
+        saved = True;
+    }
+    windowpath = inherited;
     numn = snprintf (nums, sizeof (nums), "%lu", num);
 
     if (!windowpath) {
@@ -661,39 +934,249 @@ setWindowPath (void)
     free (newwindowpath);
 }
 
+
+static int
+clientSetup (void *data)
+{
+    uid_t uid = *(uid_t *) data;
+    long long start;
+
+    loop_child ();
+    capture_child (CaptureClient);
+
+    if ( u_early_client )
+        gate_child ();
+    else if ( !set_display_env () )
+        return False;
+
+    if ( setuid (uid) == -1 ) {
+        error ("cannot change uid");
+        return False;
+    }
+    
+    setpgid (0, getpid());
+    tune_child (TuneClient);
+
+    /* DISPLAY and WINDOWPATH come from the parent once the server is up,
+     * after exec and dynamic linking where that is possible */
+    if ( u_early_client && !gate_handoff (clientspawn.path) ) {
+        start = mono_us ();
+        if ( !gate_wait () )
+            return False;
+        trace_span ("client gate", start);
+    }
+
+    trace_instant ("client exec");
+    return True;
+}
+
+/* Wait for the client's exec; should it fail the client exits and the
+ * main loop takes it from there */
+static void
+finishClient (void)
+{
+    if ( spawn_finish (&clientspawn) )
+        tune_report (TuneClient, clientpid);
+    else if ( errno != 0 )
+        error ("unable to run program \"%s\". Specify a program on the command line", clientspawn.argv[0]);
+
+    spawn_close (&clientspawn);
+}
+
 static pid_t
 startClient (char *client_argv[], uid_t euid, uid_t uid)
 {
+    static uid_t client_uid;
+    long long start;
+    int pidfd;
+
     debugx ("starting client %s: euid=%d, uid=%d", client_argv[0], euid, uid);
 
     /* We don't want to launch the client with elevated rights,
-     * so drop setuid and setgid permissions */
-    if ( euid != uid && !drop_user_privileges (uid) )
-        return -1;
+     * so drop setuid and setgid permissions; an early client does
+     * that on its own, we still need them for the server */
+    if ( u_early_client ) {
+        if ( !gate_prepare () )
+            return -1;
+    } else {
+        if ( euid != uid && !drop_user_privileges (uid) )
+            return -1;
+
+        /* Looked up here and inherited: a child sharing our connection
+         * would leave it unusable for the next one. A leased server is
+         * not ours to ask */
+        if ( xd != NULL ) {
+            start = mono_us ();
+            setWindowPath ();
+            trace_span ("setWindowPath", start);
+        }
+    }
+
+    /* setup () uses stdio, Xlib and setenv (): fork () rather than clone3 () */
+    client_uid = uid;
+    capture_prepare (CaptureClient);
+    spawn_init (&clientspawn, client_argv);
+    clientspawn.shell = SHELL;
+    clientspawn.setup = clientSetup;
+    clientspawn.data = &client_uid;
+    clientspawn.cgroup = cgroup_fd (CgroupClient);
 
     /* Elevated user id should be the same with real user id */
     euid = geteuid();
-    clientpid = fork ();
+    clientpid = spawn_start (&clientspawn, &pidfd);
+    capture_parent (CaptureClient);
     debugx ("client forked: pid=%d, euid=%d", clientpid, euid);
 
-    if ( clientpid != 0 )
-        return clientpid;
+    if ( clientpid == -1 ) {
+        if ( errno == ENOENT || errno == EACCES )
+            error ("unable to run program \"%s\". Specify a program on the command line", client_argv[0]);
+        return -1;
+    }
+    gate_parent ();
 
-    if ( !set_display_env () )
+    if ( !loop_watch_pidfd (clientpid, pidfd) )
         return -1;
 
+    if ( !u_early_client )
+        finishClient ();
+
+    return clientpid;
+}
+
+/*
+ * Let an early client go: what it could not know before the server was
+ * up goes through the gate, WINDOWPATH is looked up on our connection.
+ */
+static Bool
+releaseClient (uid_t euid, uid_t uid)
+{
+    const char *env [3];
+    char *display, *windowpath = NULL;
+    const char *value;
+    long long start;
+    int count = 0;
+    Bool result;
+
+    if ( euid != uid && !drop_user_privileges (uid) )
+        return False;
+
+    display = x_malloc (strlen (u_display) + sizeof ("DISPLAY="));
+    if ( display == NULL )
+        return False;
+
+    sprintf (display, "DISPLAY=%s", u_display);
+    env [count++] = display;
+
+    start = mono_us ();
     setWindowPath ();
+    trace_span ("setWindowPath", start);
+
+    value = getenv ("WINDOWPATH");
+    if ( value != NULL ) {
+        windowpath = x_malloc (strlen (value) + sizeof ("WINDOWPATH="));
+        if ( windowpath != NULL ) {
+            sprintf (windowpath, "WINDOWPATH=%s", value);
+            env [count++] = windowpath;
+        }
+    }
+    env [count] = NULL;
 
-    if ( setuid (uid) == -1 ) {
-        error ("cannot change uid");
-        return -1;
+    result = gate_release (env);
+    debugx ("client released: pid=%d", clientpid);
+    if ( result )
+        finishClient ();
+
+    free (display);
+    free (windowpath);
+    return result;
+}
+
+/*
+ * In a seat child: only that seat's devices are probed, and the server
+ * gets a display of its own, "-seat <name>" and the seat's arguments.
+ */
+static Bool
+startSeat (int at, int *start_of_args)
+{
+    char *args [32], **end;
+    int count = 0;
+
+    devices_keep_seat (seat_name ());
+
+    if ( !display_claim () && !u_displayfd )
+        return False;
+
+    memset (args, 0, sizeof (args));
+    if ( u_display != NULL )
+        args [count++] = u_display;
+
+    args [count++] = (char *) "-seat";
+    args [count++] = (char *) seat_name ();
+    add_args (args + count, seat_args ());
+
+    while ( count < (int) countof (args) - 1 && args [count] != NULL )
+        count++;
+
+    for ( end = server; *end != NULL; end++ )
+        ;  /* NOP */
+
+    /* keep room for what startServer () adds */
+    if ( end + count > serverargv + countof (serverargv) - 10 ) {
+        errorx ("too many server arguments");
+        return False;
     }
-    
-    setpgid (0, getpid());
-    ExecuteRelative (client_argv);
-   
-    error ("unable to run program \"%s\". Specify a program on the command line", client_argv[0]);
-    return -1;
+
+    memmove (server + at + count, server + at, (end - (server + at) + 1) * sizeof (char *));
+    memcpy (server + at, args, count * sizeof (char *));
+    *start_of_args += count;
+
+    debugx ("%s on display %s", seat_name (), u_display != NULL ? u_display : "(from -displayfd)");
+    return True;
+}
+
+/*
+ * Start the client again once its backoff is over, and the server first
+ * if that is what died. The gate only opens once, so restarted clients
+ * get DISPLAY and WINDOWPATH the direct way.
+ */
+static Bool
+restartSession (uid_t uid)
+{
+    uid_t euid = geteuid ();
+
+    u_early_client = False;
+    if ( serverDied ) {
+        serverDied = False;
+        if ( startServer (server, uid != euid) == -1 )
+            return False;
+    }
+
+    if ( startClient (client, euid, uid) == -1 )
+        return False;
+
+    restart_started ();
+    sessionChanged (serverpid, clientpid);
+    return True;
+}
+
+/* Who runs now, for the metrics, the sampler and the watchdog; -1 for
+ * one gone */
+static void
+sessionChanged (pid_t server, pid_t client)
+{
+    metrics_running (server, client);
+    sample_running (server, client);
+    if ( server > 0 )
+        watchdog_start (xd);
+}
+
+/* Of two deadlines, -1 being none */
+static long long
+earliest (long long a, long long b)
+{
+    if ( a == -1 || (b != -1 && b < a) )
+        return b;
+    return a;
 }
 
 static jmp_buf close_env;
@@ -708,6 +1191,20 @@ ignorexio (Display *dpy)
     return 0;
 }
 
+/* Also for a connection whose server is gone */
+static void
+closeDisplay (void)
+{
+    watchdog_stop ();
+    XSetIOErrorHandler (ignorexio);
+
+    /* An early client may be waiting on a server that never came up */
+    if ( xd != NULL && !setjmp (close_env) )
+        XCloseDisplay (xd);
+
+    xd = NULL;
+}
+
 static Bool
 shutdown(void)
 {
@@ -715,10 +1212,7 @@ shutdown(void)
 
     /* have kept display opened, so close it now */
     if ( clientpid > 0 ) {
-        XSetIOErrorHandler (ignorexio);
-
-        if ( !setjmp (close_env) )
-            XCloseDisplay(xd);
+        closeDisplay ();
 
         /* HUP all local clients to allow them to clean up */
         if (killpg (clientpid, SIGHUP) < 0 && errno != ESRCH)
@@ -736,7 +1230,7 @@ shutdown(void)
         return False;
     }
 
-    if (!processTimeout (10, "X server to shut down"))
+    if (!processTimeout (u_term_grace, "X server to shut down"))
         return True;
 
     errorx ("X server slow to shut down, sending KILL signal");
@@ -748,7 +1242,7 @@ shutdown(void)
         error ("can't SIGKILL X server");
     }
 
-    if (processTimeout (3, "server to die")) {
+    if (processTimeout (u_kill_grace, "server to die")) {
         errorx ("X server refuses to die");
         return False;
     }
@@ -759,6 +1253,7 @@ shutdown(void)
         
         switch (serverpid) {
         case 0:
+            loop_child ();
             execl (kbd_mode, kbd_mode, "-a", NULL);
             error ("unable to run program \"%s\"", kbd_mode);
             return False;
@@ -769,7 +1264,8 @@ shutdown(void)
 
         default:
             fprintf (stderr, "\r\nRestoring keyboard mode\r\n");
-            processTimeout (1, kbd_mode);
+            loop_watch_pid (serverpid);
+            processTimeout (1000, kbd_mode);
         }
     }
 #endif /* __sun */